@@ -9,6 +9,10 @@ typedef struct buf //协议栈的通用数据包buffer, 可以在头部装卸数
 {
     size_t len;                   // 包中有效数据大小
     uint8_t *data;                // 包的数据起始地址
+    uint16_t gso_size;            // 发送时非0表示这是一个TCP超级段，由以太网层按这个长度切分后发送；接收时为GRO合并前每段的长度
+    uint8_t csum_verified;        // GRO已经逐段验证过校验和，上层不需要再验证
+    uint16_t sum_count;           // 非0时sums有效，负载按gso_size(不是超级段时为整个负载)分段
+    uint32_t sums[BUF_MAX_SUMS];  // 每段负载的部分校验和(checksum_add的结果)，复制负载时顺便算出
     uint8_t payload[BUF_MAX_LEN]; // 最大负载数据量
 } buf_t;
 
@@ -33,13 +33,40 @@
 
 
 #define ETHERNET_MAX_TRANSPORT_UNIT 1500 //以太网最大传输单元
+#define ETHERNET_POLL_BATCH 64 //一次轮询最多收取的帧数，同一批里同一条TCP流的连续数据段会被GRO合并
 
 #define ARP_TIMEOUT_SEC (60 * 5) //arp表过期时间
 #define ARP_MIN_INTERVAL 1       //向相同地址发送arp请求的最小间隔
 
 #define IP_DEFALUT_TTL 64 //IP默认TTL
 
+#define TCP_DEFAULT_MSS 536 //对端没有通告MSS选项时使用的默认MSS(RFC 1122)
+#define TCP_RX_BUF_SIZE (16 * 1024) //每个tcp连接默认的接收缓存容量，可用tcp_set_buf_size按端口修改
+#define TCP_TX_BUF_SIZE (16 * 1024) //每个tcp连接默认的发送缓存容量
+#define TCP_SYN_QUEUE_LEN 256       //每个端口默认的半连接队列长度，满了以后改用SYN cookie
+#define TCP_SYN_TIMEOUT_SEC 30      //半连接的过期时间
+#define TCP_ACCEPT_BACKLOG 128      //tcp_open打开的端口默认的全连接队列长度
+#define TCP_EPHEMERAL_PORT_MIN 49152 //主动打开时本端临时端口的范围(RFC 6335)
+#define TCP_EPHEMERAL_PORT_MAX 65535
+#define TCP_INITIAL_RTO_MS 1000     //初始重传超时(RFC 6298)
+#define TCP_SYN_RETRIES 5           //主动打开时SYN的最大重传次数，超过后放弃连接
+#define TCP_DELAYED_ACK_MS 40       //延迟ACK的最长等待时间
+#define TCP_DELAYED_ACK_SEGS 2      //累计收到这么多个数据段后立即ACK(RFC 1122)
+#define TCP_MIN_RTO_MS 200          //重传超时的下限
+#define TCP_MAX_RTO_MS 60000        //重传超时的上限
+#define TCP_RETRIES 8               //数据的最大连续超时重传次数，超过后放弃连接
+#define TCP_INIT_CWND_SEGS 10       //初始拥塞窗口的段数(RFC 6928)
+#define TCP_DUPACK_THRESHOLD 3      //收到这么多个重复ACK后快速重传(RFC 5681)
+#define TCP_TIMEWAIT_SEC 60         //TIME_WAIT持续时间，即2MSL
+#define TCP_MAX_TIMEWAIT 262144     //TIME_WAIT条目数上限，满了以后主动关闭的连接直接释放
+#define TCP_KEEPALIVE_INTVL_SEC 75  //保活探测的间隔
+#define TCP_KEEPALIVE_PROBES 9      //保活探测的次数，都没有回应则回收连接
+#define TCP_FIN_WAIT2_TIMEOUT_SEC 60 //FIN_WAIT_2等待对端FIN的最长时间
+#define TCP_GSO_MAX_SIZE 65280     //合并成一个超级段交给以太网层切分的最大负载，不超过MSS时相当于关闭GSO
+#define TCP_SUM_BLOCK 64           //外部数据预先算好的部分校验和按这么多字节一块记录，必须是偶数
+
 #define BUF_MAX_LEN (2 * UINT16_MAX + UINT8_MAX) //buf最大长度
+#define BUF_MAX_SUMS 64 //buf中最多记录的分段负载校验和个数
 
 #define MAP_MAX_LEN (16 * BUF_MAX_LEN) //map最大长度
 #endif
\ No newline at end of file
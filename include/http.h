@@ -2,10 +2,47 @@
 #define HTTP_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define XHTTP_DOC_DIR               "../htdocs"
+#define HTTP_HEAD_MAX               8192 // 请求行加请求头的最大长度
+#define HTTP_MAX_HEADERS            32   // 解析时最多记录的请求头个数，多出的忽略
+#define HTTP_RESPONSE_HEAD_MAX      1024 // 响应头的最大长度，tx_buf至少要有这么多空间才开始处理下一个请求
+#define HTTP_KEEPALIVE_TIMEOUT_SEC  15   // 持久连接上没有新请求的最长时间
+#define HTTP_MAX_KEEPALIVE_REQUESTS 100  // 一个连接上最多处理的请求数，之后关闭
+#define HTTP_CACHE_BUDGET           (64 * 1024 * 1024) // 静态文件缓存的内容总字节数上限
+#define HTTP_CACHE_FILE_MAX         (1024 * 1024)      // 超过这个长度的文件不缓存，直接从文件发送
+#define HTTP_CACHE_CHECK_MS         1000 // 缓存条目和文件核对修改时间的间隔
+#define HTTP_MAX_ROUTES             16   // http_route最多注册的处理函数个数
+#define HTTP_CONN_BUDGET            8    // 一个连接一轮最多处理的请求数，剩下的排到就绪队列末尾由http_server_run继续
+
+typedef enum http_stream_status {
+    HTTP_STREAM_DONE, // 响应已经写完
+    HTTP_STREAM_MORE, // 还有数据，发送队列腾出空间或者调用http_stream_resume后再回调
+} http_stream_status_t;
+
+typedef struct http_stream http_stream_t;
+typedef http_stream_status_t (*http_route_handler_t)(http_stream_t* stream);
+
+struct http_stream {        // 动态处理函数的一个流式响应，HTTP/1.1用chunked编码，HTTP/1.0用关闭连接标出结束
+    struct http_conn* conn;
+    http_route_handler_t handler;
+    void* arg;              // http_route注册时的参数
+    void* ctx;              // 处理函数自己的状态，第一次回调时为NULL
+    char* path;             // 请求路径，包括查询字符串
+    uint8_t chunked;
+    uint8_t keep_alive;     // 响应结束后连接是否继续处理下一个请求
+    uint8_t started;        // 已经写了响应头
+    uint8_t done;           // 处理函数已经返回HTTP_STREAM_DONE
+    uint8_t aborted;        // 连接已经关闭，处理函数释放ctx后返回即可，写入都会失败
+};
 
 int http_server_open(uint16_t port);
+int http_route(const char* prefix, http_route_handler_t handler, void* arg);
+int http_stream_begin(http_stream_t* stream, const char* status, const char* content_type);
+size_t http_stream_write(http_stream_t* stream, const void* data, size_t len);
+int http_stream_printf(http_stream_t* stream, const char* fmt, ...);
+void http_stream_resume(http_stream_t* stream);
 void http_server_run(void);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define HTTP_ETAG_MAX 40 // ETag的最大长度，包括引号和结尾的0
+#define HTTP_DATE_MAX 32 // HTTP日期的最大长度，包括结尾的0
+
+typedef struct http_cache_entry { // 缓存的一个静态文件：文件内容和预先生成的响应头
+    char* path;                   // 键：请求路径和内容编码
+    const char* encoding;         // 压缩过的旁路文件的编码，原文件为NULL
+    uint32_t hash;
+    uint8_t missing;              // 旁路文件不存在，缓存下来免得每个请求都去打开
+    uint8_t* body;                // 文件内容
+    size_t size;
+    uint32_t* sums;               // 文件内容每TCP_SUM_BLOCK字节一块的部分校验和，发送时不必再计算
+    char* head;                   // 只和文件有关的响应头：Content-Type、ETag、Last-Modified、Accept-Ranges
+    size_t head_len;
+    char etag[HTTP_ETAG_MAX];     // 用于条件请求的比较
+    char last_modified[HTTP_DATE_MAX];
+    time_t mtime;                 // 读入时文件的修改时间和inode，用于发现文件被修改
+    ino_t ino;
+    uint64_t checked;             // 上次和文件系统核对的时间，毫秒
+    uint32_t refs;                // 发送队列中引用body的次数，为0后才能释放
+    uint8_t evicted;              // 已经移出缓存，等引用都释放后再释放
+    size_t cost;                  // 条目占用的内存，计入HTTP_CACHE_BUDGET
+    struct http_cache_entry* hash_next;
+    struct http_cache_entry *lru_prev, *lru_next; // lru_prev方向是最近使用的
+} http_cache_entry_t;
+
+http_cache_entry_t* http_cache_lookup(const char* path, const char* encoding, const char* file_path);
+http_cache_entry_t* http_cache_insert(const char* path, const char* encoding, int fd, const struct stat* st);
+void http_cache_insert_missing(const char* path, const char* encoding);
+void http_cache_release(void* arg);
+const char* http_content_type(const char* path);
+void http_validators(time_t mtime, uint64_t len, char* etag, char* last_modified);
+int http_head_format(char* buf, size_t size, const char* path, const char* encoding, const char* etag, const char* last_modified);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct ringbuf //环形字节缓冲区，容量为2的幂，读写位置自由增长，取模时按位与
+{
+    uint8_t *data; // 缓冲区起始地址
+    uint32_t size; // 容量，2的幂
+    uint32_t head; // 读位置
+    uint32_t tail; // 写位置
+} ringbuf_t;
+
+int ringbuf_init(ringbuf_t *rb, uint32_t size);
+void ringbuf_free(ringbuf_t *rb);
+uint32_t ringbuf_write(ringbuf_t *rb, const void *data, uint32_t len);
+uint32_t ringbuf_read(ringbuf_t *rb, void *data, uint32_t len);
+uint32_t ringbuf_peek(const ringbuf_t *rb, uint32_t offset, void *data, uint32_t len);
+uint32_t ringbuf_discard(ringbuf_t *rb, uint32_t len);
+const uint8_t *ringbuf_span(const ringbuf_t *rb, uint32_t offset, uint32_t *len);
+
+//缓冲区中有效数据的长度
+static inline uint32_t ringbuf_len(const ringbuf_t *rb) {
+    return rb->tail - rb->head;
+}
+
+//缓冲区剩余空间
+static inline uint32_t ringbuf_space(const ringbuf_t *rb) {
+    return rb->size - (rb->tail - rb->head);
+}
+
+#endif
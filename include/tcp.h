@@ -1,7 +1,11 @@
 #ifndef TCP_H
 #define TCP_H
 
+#include <sys/types.h>
 #include "net.h"
+#include "ip.h"
+#include "ringbuf.h"
+#include "timer.h"
 
 #pragma pack(1)
 
@@ -45,6 +49,23 @@ typedef struct tcp_peso_hdr {
 
 #pragma pack()
 
+#define TCP_OPT_END 0   // 选项列表结束
+#define TCP_OPT_NOP 1   // 填充
+#define TCP_OPT_MSS 2   // 最大报文段长度
+#define TCP_OPT_TS 8    // 时间戳(RFC 7323)
+#define TCP_OPT_MSS_LEN 4
+#define TCP_OPT_TS_LEN 10
+#define TCP_OPT_TS_SPACE 12 // 时间戳选项前面补两个NOP对齐后占用的长度
+
+// 本端MSS, 由网卡MTU推出, 保证每个TCP段都能装进一个不分片的IP数据报
+#define TCP_MSS (ETHERNET_MAX_TRANSPORT_UNIT - sizeof(ip_hdr_t) - sizeof(tcp_hdr_t))
+
+typedef struct tcp_options {
+    uint16_t mss;   // 对端通告的MSS, 0表示没有携带
+    uint8_t ts;     // 是否携带时间戳
+    uint32_t tsval; // 时间戳值
+    uint32_t tsecr; // 回显的对端时间戳
+} tcp_options_t;
 
 typedef enum tcp_state {
     // 不使用状态 TCP_CLOSED,
@@ -63,27 +84,47 @@ typedef enum tcp_state {
 } tcp_state_t;
 
 typedef struct tcp_key {
-    uint8_t ip[NET_IP_LEN];
-    uint16_t src_port;
-    uint16_t dst_port;
+    uint8_t ip[NET_IP_LEN];       // 远端IP
+    uint8_t local_ip[NET_IP_LEN]; // 本端IP
+    uint16_t src_port;            // 远端端口
+    uint16_t dst_port;            // 本端端口
 } tcp_key_t;
 
-typedef struct tcp_connect {
-    tcp_state_t state;
-    uint16_t local_port, remote_port;
-    uint8_t ip[NET_IP_LEN];
-    uint32_t unack_seq, next_seq; // tx_buf中前[next_seq - unack_seq]字节已经发送，unack_seq未确认的起始序号，next_seq下一发送序号
-    uint32_t ack;
-    uint16_t remote_mss;
-    uint16_t remote_win;
-    void* handler;
-    buf_t* rx_buf; // 接收缓存
-    buf_t* tx_buf; // 发送缓存
-} tcp_connect_t;
+typedef struct tcp_syn_entry { // 半连接，收到SYN后只记录握手需要的参数，不分配缓存
+    tcp_key_t key;
+    uint32_t hash;
+    uint32_t iss;      // 本端初始序号
+    uint32_t irs;      // 对端初始序号
+    uint16_t mss;      // 发送方向的有效MSS
+    time_t created;
+    struct tcp_syn_entry* hash_next;
+    struct tcp_syn_entry *age_prev, *age_next; // 按创建时间排列，用于过期清理
+} tcp_syn_entry_t;
 
-static const tcp_connect_t CONNECT_LISTEN = {
-    .state = TCP_LISTEN,
-};
+typedef struct tcp_timewait { // TIME_WAIT，只记录回复ACK和判断新SYN需要的信息，不分配缓存
+    tcp_key_t key;
+    uint32_t snd_nxt;    // 本端下一个序号
+    uint32_t rcv_nxt;    // 期望收到的对端序号
+    uint32_t hash_next;  // 以下都是timewait池中的下标
+    uint32_t prev, next; // 时间轮上的链表
+} tcp_timewait_t;
+
+typedef void (*tcp_release_t)(void* arg);
+
+typedef struct tcp_extent { // 发送队列中引用的一段外部数据(mmap的文件区域或应用层的内存)，确认后释放
+    void* map;                 // mmap返回的地址，release为NULL时使用
+    size_t map_len;            // 映射长度
+    tcp_release_t release;     // 引用应用层内存时，全部确认或连接释放后调用
+    void* arg;                 // release的参数
+    const uint32_t* sums;      // 可选，从sum_base开始每TCP_SUM_BLOCK字节一块的部分校验和，发送时不必再读整块数据
+    const uint8_t* sum_base;
+    const uint8_t* data;       // 第一个未确认的字节
+    uint32_t len;              // 未确认的字节数
+    uint32_t ring_before;      // 排在这段数据之前、上一段外部数据之后的tx_buf数据量
+    struct tcp_extent* next;
+} tcp_extent_t;
+
+typedef struct tcp_connect tcp_connect_t;
 
 typedef enum connect_state {
     // 刚刚建立连接
@@ -92,16 +133,140 @@ typedef enum connect_state {
     TCP_CONN_DATA_RECV,
     // 关闭连接
     TCP_CONN_CLOSED,
+    // 之前写不下的发送缓存腾出了空间
+    TCP_CONN_DATA_SENT,
+    // 对端关闭了发送方向，不会再有新数据；连接进入CLOSE_WAIT，仍然可以写入，写完后调用tcp_connect_close
+    TCP_CONN_PEER_CLOSED,
 } connect_state_t;
 
 typedef void (*tcp_handler_t)(tcp_connect_t* conect, connect_state_t state);
 
+typedef enum tcp_send_policy {
+    TCP_SEND_NAGLE,   // 默认，有未确认的数据时攒够一个MSS再发(RFC 896)
+    TCP_SEND_NODELAY, // 写入后立即发送，不等待
+    TCP_SEND_CORK,    // 只发满MSS的段，不满的部分等待tcp_connect_flush
+} tcp_send_policy_t;
+
+struct tcp_connect {
+    tcp_state_t state;
+    uint16_t local_port, remote_port;
+    uint8_t ip[NET_IP_LEN];
+    uint32_t unack_seq, next_seq; // 发送队列中前[next_seq - unack_seq]字节已经发送，unack_seq未确认的起始序号，next_seq下一发送序号
+    uint32_t ack;
+    uint16_t remote_mss; // 发送方向的有效MSS, 取对端通告值与本端MSS的较小者
+    uint16_t remote_win;
+    uint8_t fin_sent;    // FIN是否已经发出
+    uint8_t fin_queued;  // 应用层已经调用tcp_connect_close，FIN排在发送队列末尾
+    tcp_handler_t handler;
+    void* app;        // 应用层挂在连接上的数据，协议栈不使用
+    ringbuf_t rx_buf; // 接收缓存
+    ringbuf_t tx_buf; // 发送缓存, 保存已发送未确认以及尚未发送的数据
+    tcp_extent_t *tx_ext, *tx_ext_tail; // 发送队列中引用的外部数据，和tx_buf中的数据按ring_before交错排列
+    uint32_t tx_file_len;               // 外部数据的字节数，发送队列总长度为它加上tx_buf的数据量
+    uint8_t want_sent;                  // 应用层写不下而在等待，收到确认腾出空间后以TCP_CONN_DATA_SENT回调
+    uint8_t local_ip[NET_IP_LEN];
+    uint32_t hash;                             // 四元组的哈希值, 扩容时不必重新计算
+    struct tcp_connect* hash_next;             // connect_table桶内链表
+    struct tcp_connect *port_prev, *port_next; // 同一监听端口上的连接链表
+    struct tcp_listener* listener;             // 所属的监听端口
+    struct tcp_connect *accept_prev, *accept_next; // 全连接队列
+    uint8_t accepted;                          // 是否已经交给应用层
+    net_timer_t rtx_timer;                     // 重传定时器
+    uint32_t rto;                              // 当前重传超时，毫秒
+    uint8_t retries;                           // 连续重传次数
+    net_timer_t ack_timer;                     // 延迟ACK定时器
+    uint8_t ack_pending;                       // 收到后还没有确认的数据段数
+    tcp_send_policy_t policy;                  // 小段的发送策略
+    uint8_t push;                              // 是否有被tcp_connect_flush强制发送的数据
+    uint32_t push_seq;                         // 强制发送的数据的结束序号
+    uint32_t cwnd;                             // 拥塞窗口，字节
+    uint32_t ssthresh;                         // 慢启动阈值，字节
+    uint8_t dupacks;                           // 连续收到的重复ACK数
+    uint8_t in_recovery;                       // 是否处于快速恢复或超时恢复中
+    uint32_t recover;                          // 进入恢复时已发送的最大序号(RFC 6582)
+    uint32_t srtt, rttvar;                     // 平滑往返时间及其偏差，毫秒(RFC 6298)
+    uint8_t rtt_timing;                        // 是否正在对一个段计时
+    uint32_t rtt_seq;                          // 计时段的结束序号
+    uint64_t rtt_start;                        // 计时段的发送时间
+    net_timer_t persist_timer;                 // 坚持定时器，对端窗口为0且没有在途数据时探测窗口
+    uint8_t persist_backoff;                   // 坚持定时器的退避次数，窗口打开后清零
+    uint8_t persist_probes;                    // 连续没有回应的窗口探测数
+    net_timer_t keepalive_timer;               // 保活、空闲回收和FIN_WAIT_2超时共用的定时器
+    uint64_t last_recv;                        // 最后一次收到报文的时间，毫秒
+    uint32_t keepalive_idle;                   // 空闲多少秒后开始保活探测，0表示不探测
+    uint32_t keepalive_intvl;                  // 保活探测间隔，秒
+    uint32_t keepalive_probes;                 // 保活探测次数
+    uint32_t probes_sent;                      // 已经发出的没有回应的探测数
+    uint32_t idle_timeout;                     // 空闲多少秒后直接回收，0表示不回收
+    uint8_t ts_ok;                             // 握手时是否协商了时间戳
+    uint32_t ts_offset;                        // 本端时间戳相对毫秒时钟的随机偏移
+    uint32_t ts_recent;                        // 要回显给对端的时间戳
+    uint32_t last_ack_sent;                    // 最后一次发出的ACK号，决定何时更新ts_recent
+};
+
+static const tcp_connect_t CONNECT_LISTEN = {
+    .state = TCP_LISTEN,
+};
+
+
+typedef struct tcp_listener {
+    uint16_t port;
+    tcp_handler_t handler;   // 不为NULL时连接建立后立即交给它，否则进入全连接队列等待tcp_accept
+    uint32_t rx_buf_size;    // 该端口上新连接的接收缓存容量
+    uint32_t tx_buf_size;    // 该端口上新连接的发送缓存容量
+    tcp_connect_t* connects; // 该端口上的所有连接，关闭端口时不需要遍历整个连接表
+    size_t connect_count;
+    size_t syn_queue_len;    // 半连接队列长度上限
+    size_t syn_count;        // 当前半连接数
+    size_t backlog;          // 全连接队列长度上限，队列满时不再完成新的握手
+    tcp_connect_t *accept_head, *accept_tail; // 已完成握手、等待tcp_accept的连接
+    size_t accept_count;
+    uint32_t keepalive_idle;   // 以下是该端口上新连接的保活和空闲回收设置，见tcp_connect_t
+    uint32_t keepalive_intvl;
+    uint32_t keepalive_probes;
+    uint32_t idle_timeout;
+} tcp_listener_t;
+
+typedef struct tcp_stats {
+    uint64_t syn_queue_overflows; // 半连接队列已满，改用SYN cookie应答的次数
+    uint64_t syncookies_ok;       // 通过SYN cookie建立的连接数
+    uint64_t syncookies_failed;   // 无法通过校验的cookie ACK数
+    uint64_t listen_overflows;    // 全连接队列已满而丢弃的SYN和握手ACK数
+    uint64_t retransmitted_segs;  // 重传的段数
+    uint64_t fast_retransmits;    // 三个重复ACK触发的快速重传次数
+    uint64_t partial_ack_retransmits; // 恢复期间部分确认触发的重传次数
+    uint64_t rto_timeouts;        // 重传定时器超时次数
+    uint64_t recoveries;          // 收到完全确认而退出恢复的次数
+    uint64_t timewait_overflows;  // TIME_WAIT条目数达到上限而直接释放的连接数
+    uint64_t timewait_recycled;   // 被新连接复用而提前结束的TIME_WAIT数
+    uint64_t reaped_connections;  // 因保活无回应、空闲超时或FIN_WAIT_2超时而回收的连接数
+    uint64_t paws_rejected;       // 时间戳过旧被PAWS丢弃的报文数
+} tcp_stats_t;
+
+extern tcp_stats_t tcp_stats;
+
 void tcp_init();
 int tcp_open(uint16_t port, tcp_handler_t handler);
+tcp_listener_t* tcp_listen(uint16_t port, size_t backlog);
+tcp_connect_t* tcp_accept(tcp_listener_t* listener);
+tcp_connect_t* tcp_connect(uint8_t* ip, uint16_t port, tcp_handler_t handler);
+int tcp_set_buf_size(uint16_t port, uint32_t rx_size, uint32_t tx_size);
+int tcp_set_syn_queue_len(uint16_t port, size_t len);
+int tcp_set_keepalive(uint16_t port, uint32_t idle_sec, uint32_t intvl_sec, uint32_t probes);
+int tcp_set_idle_timeout(uint16_t port, uint32_t idle_sec);
 void tcp_close(uint16_t port);
 void tcp_connect_close(tcp_connect_t* connect);
 size_t tcp_connect_write(tcp_connect_t* connect, const uint8_t* data, size_t len);
+int tcp_connect_writable(tcp_connect_t* connect, size_t len);
+size_t tcp_connect_space(tcp_connect_t* connect);
+int tcp_connect_closing(tcp_connect_t* connect);
+size_t tcp_connect_sendfile(tcp_connect_t* connect, int fd, off_t offset, size_t len);
+size_t tcp_connect_send_ref(tcp_connect_t* connect, const uint8_t* data, size_t len, const uint32_t* sums, tcp_release_t release, void* arg);
 size_t tcp_connect_read(tcp_connect_t* connect, uint8_t* data, size_t len);
+const uint8_t* tcp_connect_peek(tcp_connect_t* connect, size_t offset, size_t* len);
+size_t tcp_connect_discard(tcp_connect_t* connect, size_t len);
+void tcp_connect_set_policy(tcp_connect_t* connect, tcp_send_policy_t policy);
+void tcp_connect_flush(tcp_connect_t* connect);
 void tcp_in(buf_t* buf, uint8_t* src_ip);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void (*net_timer_handler_t)(void *arg);
+
+typedef struct net_timer //协议栈的定时器，挂在时间轮上，由net_poll驱动，可以嵌入到其他结构体中
+{
+    uint64_t expire;             // 到期时间，毫秒
+    net_timer_handler_t handler; // 到期回调
+    void *arg;                   // 回调参数
+    struct net_timer *prev, *next;
+} net_timer_t;
+
+#define NET_TIMER_TICK_MS 10  //时间轮一格的时长
+#define NET_TIMER_SLOTS 1024  //时间轮格数，必须是2的幂
+
+uint64_t net_time_ms();
+void net_timer_init();
+void net_timer_set(net_timer_t *timer, uint32_t timeout_ms, net_timer_handler_t handler, void *arg);
+void net_timer_cancel(net_timer_t *timer);
+void net_timer_poll();
+
+//定时器是否正在计时
+static inline int net_timer_pending(const net_timer_t *timer) {
+    return timer->prev != NULL;
+}
+
+#endif
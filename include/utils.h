@@ -5,6 +5,9 @@
 #include <time.h>
 
 uint16_t checksum16(uint16_t *data, size_t len);
+uint32_t checksum_add(const void *data, size_t len, uint32_t sum);
+uint16_t checksum_fold(uint32_t sum);
+uint32_t checksum_copy(void *dst, const void *src, size_t len, uint32_t sum);
 
 #define constswap16(x) ((((x)&0xFF) << 8) | (((x) >> 8) & 0xFF)) //为16位数据交换大小端
 //为16位数据交换大小端
@@ -24,6 +27,14 @@ static inline uint32_t min32(uint32_t a, uint32_t b) {
     return a < b ? a : b;
 }
 
+static inline uint32_t max32(uint32_t a, uint32_t b) {
+    return a > b ? a : b;
+}
+
+static inline uint64_t min64(uint64_t a, uint64_t b) {
+    return a < b ? a : b;
+}
+
 char *iptos(uint8_t *ip);
 char *mactos(uint8_t *mac);
 char *timetos(time_t timestamp);
@@ -23,6 +23,9 @@ int buf_init(buf_t *buf, size_t len)
 
     buf->len = len;
     buf->data = buf->payload + BUF_MAX_LEN / 2 - len;
+    buf->gso_size = 0;
+    buf->csum_verified = 0;
+    buf->sum_count = 0;
     return 0;
 }
 
@@ -117,6 +120,11 @@ void buf_copy(void *pdst, const void *psrc, size_t len)
     assert(src->data + src->len < src->payload + BUF_MAX_LEN);
     dst->len = src->len;
     dst->data = dst->payload + (src->data - src->payload);
+    // 超级段和预先算好的校验和也要带上，否则arp_buf里缓存的超级段发出时不会再切分
+    dst->gso_size = src->gso_size;
+    dst->csum_verified = src->csum_verified;
+    dst->sum_count = src->sum_count;
+    memcpy(dst->sums, src->sums, sizeof(src->sums[0]) * src->sum_count);
     memcpy(dst->payload, src->payload, BUF_MAX_LEN);
 }
 
@@ -3,6 +3,7 @@
 #include "driver.h"
 #include "arp.h"
 #include "ip.h"
+#include "tcp.h"
 /**
  * @brief 处理一个收到的数据包
  * 
@@ -26,6 +27,79 @@ void ethernet_in(buf_t *buf)
     // Step3: 向上层传递数据包
     net_in(buf, protocol, src);
 }
+/**
+ * @brief 把一个TCP超级段切成gso_size大小的帧逐个交给驱动(软件GSO)
+ *        每一帧的头部从模板复制到该帧负载的前面，覆盖的是已经发出去的上一帧的数据，不需要额外复制负载。
+ *        每帧只需修改IP总长度、id、首部校验和以及TCP序号，FIN和PSH只留在最后一帧。
+ *        TCP校验和由模板头部和伪头部的部分和加上每帧的序号、长度和负载求出，负载的部分和优先用TCP复制时算好的。
+ * 
+ * @param buf 已经加好以太网、IP、TCP头部的超级段
+ */
+static void ethernet_gso_out(buf_t *buf)
+{
+    ip_hdr_t *ip_hdr = (ip_hdr_t *)(buf->data + sizeof(ether_hdr_t));
+    size_t ip_len = ip_hdr->hdr_len * IP_HDR_LEN_PER_BYTE;
+    tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)((uint8_t *)ip_hdr + ip_len);
+    size_t tcp_len = tcp_hdr->data_offset * 4;
+    size_t hdr_len = sizeof(ether_hdr_t) + ip_len + tcp_len;
+    size_t total = buf->len - hdr_len;
+    uint8_t *payload = buf->data + hdr_len;
+    uint32_t seq = swap32(tcp_hdr->seq_number32);
+    uint16_t id = swap16(ip_hdr->id16);
+    tcp_flags_t last_flags = tcp_hdr->flags;
+
+    // Step1: 保存模板头部，序号和校验和置0后求出中间帧和最后一帧两种标志位下的部分和
+    uint8_t tmpl[sizeof(ether_hdr_t) + 2 * 60];
+    memcpy(tmpl, buf->data, hdr_len);
+    tcp_hdr = (tcp_hdr_t *)(tmpl + sizeof(ether_hdr_t) + ip_len);
+    tcp_hdr->seq_number32 = 0;
+    tcp_hdr->checksum16 = 0;
+    uint8_t peso[4] = {0, ip_hdr->protocol};
+    uint32_t base = checksum_add(ip_hdr->src_ip, 2 * NET_IP_LEN, checksum_add(peso, sizeof(peso), 0));
+    uint32_t last_sum = checksum_add(tcp_hdr, tcp_len, base);
+    tcp_hdr->flags.fin = 0;
+    tcp_hdr->flags.psh = 0;
+    uint32_t mid_sum = checksum_add(tcp_hdr, tcp_len, base);
+
+    // Step2: 逐帧填写头部并发送
+    for (size_t off = 0, i = 0; off < total; off += buf->gso_size, i++)
+    {
+        size_t len = total - off < buf->gso_size ? total - off : buf->gso_size;
+        int last = off + len == total;
+        uint8_t *frame = payload + off - hdr_len;
+        memcpy(frame, tmpl, hdr_len);
+        ip_hdr_t *ip = (ip_hdr_t *)(frame + sizeof(ether_hdr_t));
+        tcp_hdr_t *tcp = (tcp_hdr_t *)((uint8_t *)ip + ip_len);
+
+        ip->total_len16 = swap16(ip_len + tcp_len + len);
+        ip->id16 = swap16(id + i);
+        ip->hdr_checksum16 = 0;
+        ip->hdr_checksum16 = checksum16((uint16_t *)ip, ip_len);
+
+        uint16_t seg_len = swap16(tcp_len + len);
+        tcp->seq_number32 = swap32(seq + off);
+        if (last)
+            tcp->flags = last_flags;
+        uint32_t sum = checksum_add(&tcp->seq_number32, 4, last ? last_sum : mid_sum);
+        sum = checksum_add(&seg_len, 2, sum);
+        if (buf->sum_count == (total + buf->gso_size - 1) / buf->gso_size)
+        {
+            // 负载的校验和在TCP复制数据时已经算出
+            sum += buf->sums[i];
+            sum += sum < buf->sums[i];
+        }
+        else
+            sum = checksum_add(payload + off, len, sum);
+        tcp->checksum16 = checksum_fold(sum);
+
+        buf->data = frame;
+        buf->len = hdr_len + len;
+        if (buf->len < sizeof(ether_hdr_t) + ETHERNET_MIN_TRANSPORT_UNIT)
+            buf_add_padding(buf, sizeof(ether_hdr_t) + ETHERNET_MIN_TRANSPORT_UNIT - buf->len);
+        driver_send(buf);
+    }
+}
+
 /**
  * @brief 处理一个要发送的数据包
  * 
@@ -56,9 +130,123 @@ void ethernet_out(buf_t *buf, const uint8_t *mac, net_protocol_t protocol)
     // Step5: 填写协议类型 protocol
     hdr->protocol16 = swap16(protocol);
 
-    // Step6: 将添加了以太网包头的数据帧发送到驱动层
-    driver_send(buf);
+    // Step6: 将添加了以太网包头的数据帧发送到驱动层，超级段先切分
+    if (buf->gso_size)
+        ethernet_gso_out(buf);
+    else
+        driver_send(buf);
+}
+static buf_t gro_buf; // GRO正在合并的包，带着第一段的以太网、IP和TCP头部
+static int gro_held;  // gro_buf里是否有包
+
+/**
+ * @brief 检查收到的帧能否参与GRO：发给本机、不分片、没有IP选项的TCP数据段，只带ACK和PSH，校验和正确。
+ *        可以参与时去掉以太网填充。
+ * 
+ * @param buf 收到的帧
+ * @return tcp_hdr_t* 可以参与时返回TCP头部，否则为NULL
+ */
+static tcp_hdr_t *ethernet_gro_check(buf_t *buf)
+{
+    if (buf->len < sizeof(ether_hdr_t) + sizeof(ip_hdr_t) + sizeof(tcp_hdr_t))
+        return NULL;
+    ether_hdr_t *eth = (ether_hdr_t *)buf->data;
+    ip_hdr_t *ip = (ip_hdr_t *)(eth + 1);
+    if (swap16(eth->protocol16) != NET_PROTOCOL_IP || ip->version != IP_VERSION_4 ||
+        ip->hdr_len != sizeof(ip_hdr_t) / IP_HDR_LEN_PER_BYTE || ip->protocol != NET_PROTOCOL_TCP ||
+        (swap16(ip->flags_fragment16) & (IP_MORE_FRAGMENT | (IP_MORE_FRAGMENT - 1))) ||
+        memcmp(ip->dst_ip, net_if_ip, NET_IP_LEN) != 0)
+        return NULL;
+    size_t total = swap16(ip->total_len16);
+    tcp_hdr_t *tcp = (tcp_hdr_t *)(ip + 1);
+    if (total > buf->len - sizeof(ether_hdr_t) || total < sizeof(ip_hdr_t) + sizeof(tcp_hdr_t) ||
+        tcp->data_offset * 4 < sizeof(tcp_hdr_t) || sizeof(ip_hdr_t) + tcp->data_offset * 4 >= total)
+        return NULL;
+    tcp_flags_t flags = tcp->flags;
+    flags.psh = 0;
+    if (memcmp(&flags, &tcp_flags_ack, sizeof(tcp_flags_t)) != 0)
+        return NULL;
+    if (checksum16((uint16_t *)ip, sizeof(ip_hdr_t)) != 0)
+        return NULL;
+    size_t tcp_len = total - sizeof(ip_hdr_t);
+    uint8_t peso[4] = {0, NET_PROTOCOL_TCP, tcp_len >> 8, tcp_len & 0xFF};
+    uint32_t sum = checksum_add(ip->src_ip, 2 * NET_IP_LEN, checksum_add(peso, sizeof(peso), 0));
+    if (checksum_fold(checksum_add(tcp, tcp_len, sum)) != 0)
+        return NULL;
+    buf->len = sizeof(ether_hdr_t) + total;
+    return tcp;
 }
+
+/**
+ * @brief 把GRO合并好的包交给协议栈，合并后的IP总长度和首部校验和在这里一次性更新
+ * 
+ */
+static void ethernet_gro_flush()
+{
+    if (!gro_held)
+        return;
+    gro_held = 0;
+    ip_hdr_t *ip = (ip_hdr_t *)(gro_buf.data + sizeof(ether_hdr_t));
+    ip->total_len16 = swap16(gro_buf.len - sizeof(ether_hdr_t));
+    ip->hdr_checksum16 = 0;
+    ip->hdr_checksum16 = checksum16((uint16_t *)ip, sizeof(ip_hdr_t));
+    ethernet_in(&gro_buf);
+}
+
+/**
+ * @brief 软件GRO：把同一条流上序号连续的数据段的负载追加到gro_buf，合并成一个大包后再交给ethernet_in。
+ *        要求ACK号、窗口和选项都与第一段相同，除最后一段外长度都相同；带PSH或不满长度的段合并后立即提交。
+ * 
+ * @param buf 收到的帧
+ * @return int 帧已经被GRO接收为1；不能参与GRO为0，这时gro_buf已经提交，由调用者按普通帧处理
+ */
+static int ethernet_gro_receive(buf_t *buf)
+{
+    tcp_hdr_t *tcp = ethernet_gro_check(buf);
+    if (tcp == NULL)
+    {
+        ethernet_gro_flush();
+        return 0;
+    }
+    ip_hdr_t *ip = (ip_hdr_t *)(buf->data + sizeof(ether_hdr_t));
+    size_t hdr_len = sizeof(ether_hdr_t) + sizeof(ip_hdr_t) + tcp->data_offset * 4;
+    size_t len = buf->len - hdr_len;
+
+    // Step1: 与gro_buf是同一条流的下一段则追加负载
+    if (gro_held)
+    {
+        ip_hdr_t *held_ip = (ip_hdr_t *)(gro_buf.data + sizeof(ether_hdr_t));
+        tcp_hdr_t *held = (tcp_hdr_t *)(held_ip + 1);
+        size_t held_len = gro_buf.len - hdr_len;
+        if (memcmp(held_ip->src_ip, ip->src_ip, NET_IP_LEN) == 0 &&
+            held->src_port16 == tcp->src_port16 && held->dst_port16 == tcp->dst_port16 &&
+            held->data_offset == tcp->data_offset &&
+            swap32(held->seq_number32) + held_len == swap32(tcp->seq_number32) &&
+            held->ack_number32 == tcp->ack_number32 && held->window_size16 == tcp->window_size16 &&
+            memcmp(held + 1, tcp + 1, tcp->data_offset * 4 - sizeof(tcp_hdr_t)) == 0 &&
+            len <= gro_buf.gso_size && gro_buf.len - sizeof(ether_hdr_t) + len <= UINT16_MAX)
+        {
+            memcpy(gro_buf.data + gro_buf.len, buf->data + hdr_len, len);
+            gro_buf.len += len;
+            held->flags.psh |= tcp->flags.psh;
+            if (tcp->flags.psh || len < gro_buf.gso_size)
+                ethernet_gro_flush();
+            return 1;
+        }
+        ethernet_gro_flush();
+    }
+
+    // Step2: 否则以这一段开始新的合并，带PSH的段直接按普通帧处理
+    if (tcp->flags.psh)
+        return 0;
+    buf_init(&gro_buf, buf->len);
+    memcpy(gro_buf.data, buf->data, buf->len);
+    gro_buf.gso_size = len;
+    gro_buf.csum_verified = 1;
+    gro_held = 1;
+    return 1;
+}
+
 /**
  * @brief 初始化以太网协议
  * 
@@ -66,14 +254,23 @@ void ethernet_out(buf_t *buf, const uint8_t *mac, net_protocol_t protocol)
 void ethernet_init()
 {
     buf_init(&rxbuf, ETHERNET_MAX_TRANSPORT_UNIT + sizeof(ether_hdr_t));
+    gro_held = 0;
 }
 
 /**
- * @brief 一次以太网轮询
+ * @brief 一次以太网轮询，最多收取ETHERNET_POLL_BATCH个帧，同一批里的TCP数据段先经过GRO合并
  * 
  */
 void ethernet_poll()
 {
-    if (driver_recv(&rxbuf) > 0)
-        ethernet_in(&rxbuf);
+    for (int i = 0; i < ETHERNET_POLL_BATCH; i++)
+    {
+        // 上一帧处理时去掉了头部，每次都重新初始化，保证帧从同一位置开始
+        buf_init(&rxbuf, ETHERNET_MAX_TRANSPORT_UNIT + sizeof(ether_hdr_t));
+        if (driver_recv(&rxbuf) <= 0)
+            break;
+        if (!ethernet_gro_receive(&rxbuf))
+            ethernet_in(&rxbuf);
+    }
+    ethernet_gro_flush();
 }
@@ -1,166 +1,1017 @@
 #include "http.h"
+#include "http_cache.h"
 #include "tcp.h"
 #include "net.h"
 #include "assert.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct http_header { // 请求头的名字和值，指向请求头所在的缓存，不复制
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+} http_header_t;
+
+typedef struct http_request { // 解析后的请求，所有字段都指向请求头所在的缓存
+    const char* method;
+    size_t method_len;
+    const char* path;
+    size_t path_len;
+    int minor_version; // HTTP/1.x中的x
+    size_t header_count;
+    http_header_t headers[HTTP_MAX_HEADERS];
+} http_request_t;
+
+typedef struct http_conn { // 一个连接上的请求状态，挂在tcp_connect_t的app上，每次收到数据从上次停下的地方继续
+    tcp_connect_t* tcp;
+    size_t scan;                // rx_buf中已经查找过请求头结束标志的长度
+    size_t last_nl;             // 上一个换行符之后的位置，用来判断空行
+    size_t head_len;            // 已经找到的完整请求头的长度，响应写不下时留到TCP_CONN_DATA_SENT再处理
+    uint64_t body_left;         // 上一个请求还没有丢弃的请求体长度
+    uint32_t requests;          // 这个连接上已经处理的请求数
+    net_timer_t idle_timer;     // 持久连接的空闲超时，流式响应期间暂停
+    http_stream_t* stream;      // 正在进行的流式响应，结束前不处理后面的请求
+    struct http_conn *ready_prev, *ready_next; // 就绪队列
+    uint8_t ready;              // 是否在就绪队列中
+    uint8_t peer_closed;        // 对端已经关闭发送方向，rx_buf中的请求都处理完后关闭连接
+} http_conn_t;
+
+/* 就绪队列放置用完了一轮的处理额度、rx_buf中可能还有请求的连接，按先后串成双向链表，不限长度。
+    http_server_run每次按顺序给队列中的每个连接一轮额度，没处理完的重新排到末尾，
+    这样一个流水线发来大量请求的客户端不会让其他连接等待。
+*/
+static struct {
+    http_conn_t *head, *tail;
+    size_t count;
+} http_ready;
+
+#define HTTP_CHUNK_OVERHEAD 20 // 一块chunked数据的长度行和结尾的\r\n最多占用的字节数
+
+typedef struct http_route { // 按路径前缀注册的动态处理函数
+    char* prefix;
+    size_t prefix_len;
+    http_route_handler_t handler;
+    void* arg;
+} http_route_t;
+
+static http_route_t http_routes[HTTP_MAX_ROUTES];
+static size_t http_route_count;
+
+static void http_conn_run(http_conn_t* conn);
+
+static char http_head_buf[HTTP_HEAD_MAX]; // 请求头跨过rx_buf末尾绕回时拼成连续的一段，解析和处理都在一次回调内完成，所有连接共用
+
+/**
+ * @brief 在rx_buf中原地查找请求头结束的空行，从上次查找停下的位置继续，每个字节只看一次
+ *
+ * @param conn
+ * @return size_t 请求头(包括最后的空行)的长度，还没有收完为0
+ */
+static size_t http_head_scan(http_conn_t* conn) {
+    size_t len;
+    const uint8_t* data;
+    while (len = SIZE_MAX, (data = tcp_connect_peek(conn->tcp, conn->scan, &len)), len > 0) {
+        const uint8_t* nl = memchr(data, '\n', len);
+        if (nl == NULL) {
+            conn->scan += len;
+            continue;
+        }
+        size_t pos = conn->scan + (nl - data);
+        conn->scan = pos + 1;
+        size_t line = pos - conn->last_nl; // 这一行除去\n的长度
+        conn->last_nl = pos + 1;
+        if (line == 0) {
+            return conn->head_len = pos + 1;
+        }
+        if (line == 1) {
+            size_t one = 1;
+            if (*tcp_connect_peek(conn->tcp, pos - 1, &one) == '\r') {
+                return conn->head_len = pos + 1;
+            }
+        }
+    }
+    return 0;
+}
 
-#define TCP_FIFO_SIZE 40
-
-typedef struct http_fifo {
-    tcp_connect_t* buffer[TCP_FIFO_SIZE];
-    uint8_t front, tail, count;
-} http_fifo_t;
-
-static http_fifo_t http_fifo_v;
+/**
+ * @brief 查找请求头，名字不区分大小写
+ *
+ * @param req
+ * @param name
+ * @return const http_header_t* 找不到为NULL
+ */
+static const http_header_t* http_header_get(const http_request_t* req, const char* name) {
+    size_t len = strlen(name);
+    for (size_t i = 0; i < req->header_count; i++) {
+        const http_header_t* h = &req->headers[i];
+        size_t j = 0;
+        while (j < len && j < h->name_len && tolower((unsigned char)h->name[j]) == tolower((unsigned char)name[j])) {
+            j++;
+        }
+        if (j == len && h->name_len == len) {
+            return h;
+        }
+    }
+    return NULL;
+}
 
-static void http_fifo_init(http_fifo_t* fifo) {
-    fifo->count = 0;
-    fifo->front = 0;
-    fifo->tail = 0;
+/**
+ * @brief 判断逗号分隔的请求头值中是否有某个选项，不区分大小写，比如Connection: keep-alive, Upgrade
+ *
+ * @param h
+ * @param token
+ * @return int 有为1
+ */
+static int http_header_has_token(const http_header_t* h, const char* token) {
+    size_t len = strlen(token);
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char* q = p;
+        while (q < end && *q != ',') {
+            q++;
+        }
+        const char* e = q;
+        while (e > p && e[-1] == ' ') {
+            e--;
+        }
+        size_t j = 0;
+        while (j < len && p + j < e && tolower((unsigned char)p[j]) == tolower((unsigned char)token[j])) {
+            j++;
+        }
+        if (j == len && p + len == e) {
+            return 1;
+        }
+        p = q;
+    }
+    return 0;
 }
 
-static int http_fifo_in(http_fifo_t* fifo, tcp_connect_t* tcp) {
-    if (fifo->count >= TCP_FIFO_SIZE) {
+/**
+ * @brief 解析请求行和请求头，一遍扫描，结果中的字段都指向head，不复制
+ *
+ * @param head 完整的请求头，以空行结束
+ * @param len
+ * @param req 输出
+ * @return int 成功为0，格式错误为-1
+ */
+static int http_parse(const char* head, size_t len, http_request_t* req) {
+    const char* end = head + len;
+    const char* p = head;
+    const char* eol = memchr(p, '\n', end - p);
+    size_t n = eol - p;
+    if (n && p[n - 1] == '\r') {
+        n--;
+    }
+
+    // 请求行：方法 路径 HTTP/1.x
+    const char* sp = memchr(p, ' ', n);
+    if (sp == NULL) {
         return -1;
     }
-    fifo->buffer[fifo->front] = tcp;
-    fifo->front++;
-    if (fifo->front >= TCP_FIFO_SIZE) {
-        fifo->front = 0;
+    req->method = p;
+    req->method_len = sp - p;
+    const char* path = sp + 1;
+    while (path < p + n && *path == ' ') {
+        path++;
+    }
+    sp = memchr(path, ' ', p + n - path);
+    req->path = path;
+    req->path_len = (sp ? sp : p + n) - path;
+    req->minor_version = 0;
+    if (sp && p + n - sp == 9 && memcmp(sp + 1, "HTTP/1.", 7) == 0 && sp[8] >= '0' && sp[8] <= '9') {
+        req->minor_version = sp[8] - '0';
+    }
+    if (req->method_len == 0 || req->path_len == 0) {
+        return -1;
+    }
+
+    // 请求头：名字: 值，到空行为止
+    req->header_count = 0;
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        n = eol - p;
+        if (n && p[n - 1] == '\r') {
+            n--;
+        }
+        if (n == 0) {
+            break;
+        }
+        const char* colon = memchr(p, ':', n);
+        if (colon == NULL) {
+            return -1;
+        }
+        if (req->header_count == HTTP_MAX_HEADERS) {
+            continue;
+        }
+        http_header_t* h = &req->headers[req->header_count++];
+        const char* value = colon + 1;
+        const char* value_end = p + n;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        h->name = p;
+        h->name_len = colon - p;
+        h->value = value;
+        h->value_len = value_end - value;
     }
-    fifo->count++;
     return 0;
 }
 
-static tcp_connect_t* http_fifo_out(http_fifo_t* fifo) {
-    if (fifo->count == 0) {
-        return NULL;
+static size_t http_send(tcp_connect_t* tcp, const char* buf, size_t size) {
+    return tcp_connect_write(tcp, (const uint8_t*)buf, size);
+}
+
+/**
+ * @brief 释放流式响应
+ *
+ * @param conn
+ */
+static void http_stream_free(http_conn_t* conn) {
+    free(conn->stream->path);
+    free(conn->stream);
+    conn->stream = NULL;
+}
+
+/**
+ * @brief 把连接排到就绪队列末尾，已经在队列中时不动
+ *
+ * @param conn
+ */
+static void http_ready_push(http_conn_t* conn) {
+    if (conn->ready) {
+        return;
     }
-    tcp_connect_t* tcp = fifo->buffer[fifo->tail];
-    fifo->tail++;
-    if (fifo->tail >= TCP_FIFO_SIZE) {
-        fifo->tail = 0;
+    conn->ready = 1;
+    conn->ready_next = NULL;
+    conn->ready_prev = http_ready.tail;
+    if (http_ready.tail) {
+        http_ready.tail->ready_next = conn;
+    } else {
+        http_ready.head = conn;
     }
-    fifo->count--;
-    return tcp;
+    http_ready.tail = conn;
+    http_ready.count++;
 }
 
-static size_t get_line(tcp_connect_t* tcp, char* buf, size_t size) {
-    size_t i = 0;
-    while (i < size) {
-        char c;
-        if (tcp_connect_read(tcp, (uint8_t*)&c, 1) > 0) {
-            if (c == '\n') {
-                break;
-            }
-            if (c != '\n' && c != '\r') {
-                buf[i] = c;
-                i++;
-            }
-        }
-        net_poll();
+/**
+ * @brief 把连接移出就绪队列
+ *
+ * @param conn
+ */
+static void http_ready_remove(http_conn_t* conn) {
+    if (!conn->ready) {
+        return;
+    }
+    if (conn->ready_prev) {
+        conn->ready_prev->ready_next = conn->ready_next;
+    } else {
+        http_ready.head = conn->ready_next;
+    }
+    if (conn->ready_next) {
+        conn->ready_next->ready_prev = conn->ready_prev;
+    } else {
+        http_ready.tail = conn->ready_prev;
     }
-    buf[i] = '\0';
-    return i;
+    conn->ready = 0;
+    http_ready.count--;
 }
 
-static size_t http_send(tcp_connect_t* tcp, const char* buf, size_t size) {
-    size_t send = 0;
-    while (send < size) {
-        send += tcp_connect_write(tcp, (const uint8_t*)buf + send, size - send);
-        net_poll();
+/**
+ * @brief 释放请求状态；流式响应还没有结束时以aborted再回调一次处理函数，让它释放自己的状态
+ *
+ * @param conn
+ */
+static void http_conn_free(http_conn_t* conn) {
+    net_timer_cancel(&conn->idle_timer);
+    http_ready_remove(conn);
+    if (conn->stream) {
+        conn->stream->aborted = 1;
+        if (!conn->stream->done)
+            conn->stream->handler(conn->stream);
+        http_stream_free(conn);
     }
-    return send;
+    free(conn);
 }
 
-static void close_http(tcp_connect_t* tcp) {
+/**
+ * @brief 关闭连接并释放请求状态，之后该连接的回调不再有app
+ *
+ * @param conn
+ */
+static void close_http(http_conn_t* conn) {
+    tcp_connect_t* tcp = conn->tcp;
+    tcp->app = NULL;
+    http_conn_free(conn);
     tcp_connect_close(tcp);
-    printf("http closed.\n");
 }
 
+/**
+ * @brief 持久连接空闲超时，关闭连接
+ *
+ * @param arg 连接的请求状态
+ */
+static void http_idle_timeout(void* arg) {
+    close_http(arg);
+}
+
+/**
+ * @brief 判断If-None-Match/If-Range中逗号分隔的实体标签是否包含etag，按弱比较忽略W/前缀
+ *
+ * @param h
+ * @param etag
+ * @return int 包含或者为*时为1
+ */
+static int http_etag_match(const http_header_t* h, const char* etag) {
+    size_t len = strlen(etag);
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char* q = p;
+        while (q < end && *q != ',') {
+            q++;
+        }
+        const char* e = q;
+        while (e > p && e[-1] == ' ') {
+            e--;
+        }
+        if (e - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if ((e - p == 1 && *p == '*') || ((size_t)(e - p) == len && memcmp(p, etag, len) == 0)) {
+            return 1;
+        }
+        p = q;
+    }
+    return 0;
+}
+
+/**
+ * @brief 判断条件请求能否用304回答：有If-None-Match时只看它，否则看If-Modified-Since。
+ *        If-Modified-Since要求和Last-Modified完全相同，客户端通常原样带回上次收到的值，
+ *        这样不用解析日期，也不会因为时钟不一致把修改过的文件当成没有修改
+ *
+ * @param req
+ * @param etag
+ * @param last_modified
+ * @return int 没有修改为1
+ */
+static int http_not_modified(const http_request_t* req, const char* etag, const char* last_modified) {
+    const http_header_t* h = http_header_get(req, "If-None-Match");
+    if (h) {
+        return http_etag_match(h, etag);
+    }
+    h = http_header_get(req, "If-Modified-Since");
+    return h && last_modified[0] && h->value_len == strlen(last_modified) && memcmp(h->value, last_modified, h->value_len) == 0;
+}
+
+/**
+ * @brief 解析单个范围的Range请求头：bytes=a-b、bytes=a-、bytes=-n。
+ *        格式不对、有多个范围、或者If-Range和当前文件不符时忽略，按整个文件回答
+ *
+ * @param req
+ * @param size 文件长度
+ * @param etag
+ * @param last_modified
+ * @param start 输出范围的起点
+ * @param len 输出范围的长度
+ * @return int 没有范围为0，有效范围为1，范围超出文件为-1
+ */
+static int http_range(const http_request_t* req, uint64_t size, const char* etag, const char* last_modified, uint64_t* start, uint64_t* len) {
+    const http_header_t* h = http_header_get(req, "Range");
+    size_t unit = 0;
+    while (h && unit < 6 && unit < h->value_len && tolower((unsigned char)h->value[unit]) == "bytes="[unit]) {
+        unit++;
+    }
+    if (unit < 6) {
+        return 0;
+    }
+    const http_header_t* if_range = http_header_get(req, "If-Range");
+    if (if_range && !(if_range->value_len == strlen(etag) && memcmp(if_range->value, etag, if_range->value_len) == 0) &&
+        !(if_range->value_len == strlen(last_modified) && memcmp(if_range->value, last_modified, if_range->value_len) == 0)) {
+        return 0;
+    }
 
+    const char* p = h->value + 6;
+    const char* end = h->value + h->value_len;
+    uint64_t first = 0, last = 0;
+    int has_first = 0, has_last = 0;
+    for (; p < end && *p >= '0' && *p <= '9' && first <= UINT32_MAX; p++, has_first = 1) {
+        first = first * 10 + *p - '0';
+    }
+    if (p == end || *p != '-') {
+        return 0;
+    }
+    for (p++; p < end && *p >= '0' && *p <= '9' && last <= UINT32_MAX; p++, has_last = 1) {
+        last = last * 10 + *p - '0';
+    }
+    if (p != end || (!has_first && !has_last) || (has_first && has_last && last < first)) {
+        return 0;
+    }
+    if (!has_first) { // 最后n个字节
+        if (last == 0 || size == 0) {
+            return -1;
+        }
+        first = last < size ? size - last : 0;
+        last = size - 1;
+    } else if (!has_last || last >= size) {
+        last = size - 1;
+    }
+    if (first >= size) {
+        return -1;
+    }
+    *start = first;
+    *len = last - first + 1;
+    return 1;
+}
+
+/**
+ * @brief 判断Accept-Encoding是否接受某种内容编码：列出且q不为0，或者没有列出但*的q不为0
+ *
+ * @param req
+ * @param coding
+ * @return int 接受为1
+ */
+static int http_accept_encoding(const http_request_t* req, const char* coding) {
+    const http_header_t* h = http_header_get(req, "Accept-Encoding");
+    if (h == NULL) {
+        return 0;
+    }
+    size_t len = strlen(coding);
+    int star = 0;
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char* q = p;
+        while (q < end && *q != ',') {
+            q++;
+        }
+        const char* e = p;
+        while (e < q && *e != ';' && *e != ' ') {
+            e++;
+        }
+        // q=0、q=0.0等都表示不接受，只要q值中有非0数字就接受
+        int accept = 1;
+        const char* param = memchr(e, ';', q - e);
+        while (param && param < q && (*param == ';' || *param == ' ')) {
+            param++;
+        }
+        if (param && param + 1 < q && (*param == 'q' || *param == 'Q') && param[1] == '=') {
+            accept = 0;
+            for (const char* v = param + 2; v < q; v++) {
+                if (*v >= '1' && *v <= '9') {
+                    accept = 1;
+                }
+            }
+        }
+        size_t j = 0;
+        while (j < len && p + j < e && tolower((unsigned char)p[j]) == coding[j]) {
+            j++;
+        }
+        if (j == len && p + len == e) {
+            return accept;
+        }
+        if (e - p == 1 && *p == '*') {
+            star = accept;
+        }
+        p = q;
+    }
+    return star;
+}
+
+/**
+ * @brief 打开一个路径的某种表示：先查缓存，没有再打开文件并尝试加入缓存。
+ *        压缩过的旁路文件不存在时也记入缓存，免得每个请求都去打开
+ *
+ * @param path 请求路径
+ * @param encoding 内容编码，原文件为NULL
+ * @param suffix 旁路文件的后缀
+ * @param entry 输出缓存条目，文件太大不缓存时为NULL
+ * @param fd 输出打开的文件，缓存命中时为-1
+ * @param st 输出fd的fstat结果
+ * @return int 找到为0，不存在为-1
+ */
+static int http_open_file(const char* path, const char* encoding, const char* suffix, http_cache_entry_t** entry, int* fd, struct stat* st) {
+    char file_path[HTTP_HEAD_MAX + 32 + sizeof(XHTTP_DOC_DIR)];
+    snprintf(file_path, sizeof(file_path), "%s%s%s", XHTTP_DOC_DIR, path, suffix);
+    *fd = -1;
+    *entry = http_cache_lookup(path, encoding, file_path);
+    if (*entry) {
+        return (*entry)->missing ? -1 : 0;
+    }
+    *fd = open(file_path, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+        // 只有原文件存在时才记下旁路文件不存在，否则随机的404路径会把有用的条目挤出缓存
+        struct stat base;
+        snprintf(file_path, sizeof(file_path), "%s%s", XHTTP_DOC_DIR, path);
+        if (encoding && stat(file_path, &base) == 0 && S_ISREG(base.st_mode))
+            http_cache_insert_missing(path, encoding);
+        return -1;
+    }
+    *entry = http_cache_insert(path, encoding, *fd, st);
+    if (*entry) {
+        close(*fd);
+        *fd = -1;
+    }
+    return 0;
+}
 
-static void send_file(tcp_connect_t* tcp, const char* url) {
-    FILE* file;
-    uint32_t size;
-    // const char* content_type = "text/html";
-    char file_path[255];
-    char tx_buffer[1024];
+static void send_file(tcp_connect_t* tcp, const http_request_t* req, const char* url, int keep_alive) {
+    static const struct {
+        const char* encoding;
+        const char* suffix;
+    } sidecars[] = {{"br", ".br"}, {"gzip", ".gz"}}; // 按优先顺序
+    int fd = -1;
+    struct stat st;
+    char path[HTTP_HEAD_MAX + 16];
+    char tx_buffer[HTTP_RESPONSE_HEAD_MAX];
+    const char* connection = keep_alive ? "keep-alive" : "close";
+    const char* encoding = NULL;
 
     /*
     解析url路径，查看是否是查看XHTTP_DOC_DIR目录下的文件
     如果不是，则发送404 NOT FOUND
-    如果是，则用HTTP/1.0协议发送
+    如果是，则用HTTP/1.1协议发送，用Content-Length标出响应的结束，持久连接上可以继续下一个请求
+    小文件放在内存缓存中，命中时不访问文件系统
+    客户端接受压缩时优先发送事先压缩好的旁路文件，比如index.html.gz
+    条件请求没有修改时回答304，单个范围的Range请求回答206
 
     注意，本实验的WEB服务器网页存放在XHTTP_DOC_DIR目录中
     */
 
    // TODO
-
+   http_cache_entry_t* entry = NULL;
+   int found = -1;
+   if (strstr(url, "..") == NULL) { // 不允许访问XHTTP_DOC_DIR之外的文件
+        snprintf(path, sizeof(path), "%s", strcmp(url, "/") == 0 ? "/index.html" : url);
+        for (size_t i = 0; found != 0 && i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+            if (http_accept_encoding(req, sidecars[i].encoding)) {
+                found = http_open_file(path, sidecars[i].encoding, sidecars[i].suffix, &entry, &fd, &st);
+                encoding = found == 0 ? sidecars[i].encoding : NULL;
+            }
+        }
+        if (found != 0) {
+            found = http_open_file(path, NULL, "", &entry, &fd, &st);
+        }
+   }
+   if (found != 0) {
+        int len = snprintf(tx_buffer, sizeof(tx_buffer),
+            "HTTP/1.1 404 NOT FOUND\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n", connection);
+        http_send(tcp, tx_buffer, len);
+        return;
+   }
+
+   // 条件请求和范围请求需要的信息，缓存命中时都在条目里，否则由fstat的结果生成
+   char etag_buf[HTTP_ETAG_MAX], last_modified_buf[HTTP_DATE_MAX], entity_buf[HTTP_RESPONSE_HEAD_MAX / 2];
+   const char *etag, *last_modified, *entity;
+   int entity_len;
+   uint64_t size;
+   if (entry) {
+        etag = entry->etag;
+        last_modified = entry->last_modified;
+        entity = entry->head;
+        entity_len = entry->head_len;
+        size = entry->size;
+   } else {
+        http_validators(st.st_mtime, st.st_size, etag_buf, last_modified_buf);
+        etag = etag_buf;
+        last_modified = last_modified_buf;
+        entity = entity_buf;
+        entity_len = http_head_format(entity_buf, sizeof(entity_buf), path, encoding, etag, last_modified);
+        size = st.st_size;
+   }
+
+   uint64_t start = 0, len = size;
+   int range = 0, head_len;
+   if (http_not_modified(req, etag, last_modified)) {
+        head_len = snprintf(tx_buffer, sizeof(tx_buffer), "HTTP/1.1 304 Not Modified\r\n%.*sConnection: %s\r\n\r\n",
+            entity_len, entity, connection);
+        len = 0;
+   } else if ((range = http_range(req, size, etag, last_modified, &start, &len)) < 0) {
+        head_len = snprintf(tx_buffer, sizeof(tx_buffer),
+            "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+            (unsigned long long)size, connection);
+        len = 0;
+   } else if (range) {
+        head_len = snprintf(tx_buffer, sizeof(tx_buffer),
+            "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n%.*sConnection: %s\r\n\r\n",
+            (unsigned long long)start, (unsigned long long)(start + len - 1), (unsigned long long)size, (unsigned long long)len,
+            entity_len, entity, connection);
+   } else {
+        head_len = snprintf(tx_buffer, sizeof(tx_buffer), "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n%.*sConnection: %s\r\n\r\n",
+            (unsigned long long)size, entity_len, entity, connection);
+   }
+   http_send(tcp, tx_buffer, head_len);
+
+   if (entry) {
+        // 响应头和校验和都是缓存好的，文件内容直接引用缓存，发送完成前缓存条目不会释放；
+        // 范围不从校验和分块的边界开始时改为复制时计算校验和
+        if (len) {
+            entry->refs++;
+            const uint32_t* sums = start % TCP_SUM_BLOCK ? NULL : entry->sums + start / TCP_SUM_BLOCK;
+            if (tcp_connect_send_ref(tcp, entry->body + start, len, sums, http_cache_release, entry) == 0)
+                http_cache_release(entry);
+        }
+        return;
+   }
+
+   // 大文件内容直接从mmap的页组装报文段，不经过用户缓冲区和tx_buf
+   uint64_t done = 0;
+   while (done < len) {
+        size_t n = tcp_connect_sendfile(tcp, fd, start + done, len - done);
+        if (n == 0)
+            break;
+        done += n;
+   }
+   close(fd);
 }
 
-static void http_handler(tcp_connect_t* tcp, connect_state_t state) {
-    if (state == TCP_CONN_CONNECTED) {
-        http_fifo_in(&http_fifo_v, tcp);
-        printf("http conntected.\n");
-    } else if (state == TCP_CONN_DATA_RECV) {
-    } else if (state == TCP_CONN_CLOSED) {
-        printf("http closed.\n");
-    } else {
-        assert(0);
+/**
+ * @brief 按最长前缀查找请求路径对应的处理函数
+ *
+ * @param path
+ * @param len
+ * @return const http_route_t* 没有为NULL
+ */
+static const http_route_t* http_route_find(const char* path, size_t len) {
+    const http_route_t* best = NULL;
+    for (size_t i = 0; i < http_route_count; i++) {
+        const http_route_t* route = &http_routes[i];
+        if (route->prefix_len <= len && memcmp(route->prefix, path, route->prefix_len) == 0 &&
+            (best == NULL || route->prefix_len > best->prefix_len)) {
+            best = route;
+        }
     }
+    return best;
 }
 
+/**
+ * @brief 为请求创建流式响应，HTTP/1.0的客户端不认识chunked编码，改为写完后关闭连接
+ *
+ * @param conn
+ * @param route
+ * @param req
+ * @param keep_alive
+ * @return int 成功为0，分配失败为-1
+ */
+static int http_stream_new(http_conn_t* conn, const http_route_t* route, const http_request_t* req, int keep_alive) {
+    http_stream_t* stream = calloc(1, sizeof(http_stream_t));
+    if (stream == NULL) {
+        return -1;
+    }
+    stream->path = malloc(req->path_len + 1);
+    if (stream->path == NULL) {
+        free(stream);
+        return -1;
+    }
+    memcpy(stream->path, req->path, req->path_len);
+    stream->path[req->path_len] = '\0';
+    stream->conn = conn;
+    stream->handler = route->handler;
+    stream->arg = route->arg;
+    stream->chunked = req->minor_version >= 1;
+    stream->keep_alive = keep_alive && stream->chunked;
+    conn->stream = stream;
+    return 0;
+}
 
-// 在端口上创建服务器。
+/**
+ * @brief 推进连接上的流式响应：回调处理函数，写完后补上chunked编码的结束块。
+ *        这期间的多次写入攒在一起再发出，在回调之外(http_stream_resume)写入时也不会因为Nagle拆成小段
+ *
+ * @param conn
+ * @return int 还没有结束为1，结束并已释放为0
+ */
+static int http_stream_run(http_conn_t* conn) {
+    http_stream_t* stream = conn->stream;
+    tcp_connect_t* tcp = conn->tcp;
+    tcp_send_policy_t policy = tcp->policy;
+    tcp_connect_set_policy(tcp, TCP_SEND_CORK);
+    if (!stream->done && stream->handler(stream) != HTTP_STREAM_MORE) {
+        stream->done = 1;
+    }
+    if (stream->done && (stream->started || http_stream_begin(stream, "200 OK", "text/plain") == 0) &&
+        (!stream->chunked || tcp_connect_writable(tcp, 5))) {
+        if (stream->chunked) {
+            http_send(tcp, "0\r\n\r\n", 5);
+        }
+        http_stream_free(conn);
+    }
+    tcp_connect_set_policy(tcp, policy);
+    return conn->stream != NULL;
+}
 
-int http_server_open(uint16_t port) {
-    if (!tcp_open(port, http_handler)) {
+/**
+ * @brief 写流式响应的响应头，不调用时第一次写入会用200和application/octet-stream自动写。
+ *        第一次回调时一定写得下，之后写不下时返回-1，等TCP_CONN_DATA_SENT后再回调
+ *
+ * @param stream
+ * @param status 状态码和原因，比如"200 OK"
+ * @param content_type
+ * @return int 成功为0
+ */
+int http_stream_begin(http_stream_t* stream, const char* status, const char* content_type) {
+    char head[HTTP_RESPONSE_HEAD_MAX];
+    if (stream->started || stream->aborted) {
         return -1;
     }
-    http_fifo_init(&http_fifo_v);
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%sCache-Control: no-cache\r\nConnection: %s\r\n\r\n",
+        status, content_type, stream->chunked ? "Transfer-Encoding: chunked\r\n" : "", stream->keep_alive ? "keep-alive" : "close");
+    if (len < 0 || (size_t)len >= sizeof(head) || !tcp_connect_writable(stream->conn->tcp, len)) {
+        return -1;
+    }
+    http_send(stream->conn->tcp, head, len);
+    stream->started = 1;
     return 0;
 }
 
-// 从FIFO取出请求并处理。新的HTTP请求时会发送到FIFO中等待处理。
+/**
+ * @brief 写入流式响应的数据，每次写入是一块chunked数据。发送队列放不下时只写一部分，
+ *        返回值小于len时处理函数应保存进度并返回HTTP_STREAM_MORE，腾出空间后会再被回调
+ *
+ * @param stream
+ * @param data
+ * @param len
+ * @return size_t 写入的字节数
+ */
+size_t http_stream_write(http_stream_t* stream, const void* data, size_t len) {
+    tcp_connect_t* tcp = stream->conn->tcp;
+    if (stream->aborted || len == 0 || (!stream->started && http_stream_begin(stream, "200 OK", "application/octet-stream") != 0)) {
+        return 0;
+    }
+    if (!stream->chunked) {
+        return tcp_connect_write(tcp, data, len);
+    }
+    if (!tcp_connect_writable(tcp, len + HTTP_CHUNK_OVERHEAD)) {
+        size_t space = tcp_connect_space(tcp);
+        if (space <= HTTP_CHUNK_OVERHEAD) {
+            return 0;
+        }
+        len = space - HTTP_CHUNK_OVERHEAD;
+    }
+    char line[HTTP_CHUNK_OVERHEAD];
+    int n = snprintf(line, sizeof(line), "%llx\r\n", (unsigned long long)len);
+    http_send(tcp, line, n);
+    tcp_connect_write(tcp, data, len);
+    http_send(tcp, "\r\n", 2);
+    return len;
+}
 
-void http_server_run(void) {
-    tcp_connect_t* tcp;
-    char url_path[255];
-    char rx_buffer[1024];
+/**
+ * @brief 格式化后整段写入流式响应，写不下时什么也不写
+ *
+ * @param stream
+ * @param fmt
+ * @param ...
+ * @return int 写入的字节数，写不下或者超过HTTP_RESPONSE_HEAD_MAX为-1
+ */
+int http_stream_printf(http_stream_t* stream, const char* fmt, ...) {
+    char buf[HTTP_RESPONSE_HEAD_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= sizeof(buf) || stream->aborted ||
+        (!stream->started && http_stream_begin(stream, "200 OK", "text/plain") != 0) ||
+        !tcp_connect_writable(stream->conn->tcp, len + (stream->chunked ? HTTP_CHUNK_OVERHEAD : 0))) {
+        return -1;
+    }
+    return http_stream_write(stream, buf, len);
+}
 
-    while ((tcp = http_fifo_out(&http_fifo_v)) != NULL) {
-        int i;
-        char* c = rx_buffer;
+/**
+ * @brief 处理函数返回HTTP_STREAM_MORE时并没有被阻塞，而是在等待新数据(比如定时产生的监控数据)，
+ *        数据就绪后调用这个函数再次回调处理函数。不能在处理函数中调用
+ *
+ * @param stream
+ */
+void http_stream_resume(http_stream_t* stream) {
+    http_conn_run(stream->conn);
+}
 
+/**
+ * @brief 推进一个连接的请求状态机：请求头没有收完时返回，等下次TCP_CONN_DATA_RECV再继续查找；
+ *        收完后原地解析并处理，处理完才从rx_buf中移除请求头。
+ *        持久连接上按顺序处理rx_buf中所有流水线发来的请求，响应按同样的顺序排入发送队列；
+ *        tx_buf放不下响应头时停下，等TCP_CONN_DATA_SENT再继续。
+ *        响应全部排入发送队列，不等待发送完成，因此一个慢的客户端不会阻塞其他连接。
+ *        注册了处理函数的路径产生流式响应，它结束前后面的请求留在rx_buf中。
+ *        每次最多处理HTTP_CONN_BUDGET个请求，剩下的排入就绪队列，由http_server_run轮流处理
+ *
+ * @param conn
+ */
+static void http_conn_run(http_conn_t* conn) {
+    http_ready_remove(conn);
+    // 本端的FIN已经排在发送队列末尾时不能再写入，剩下的请求不再处理，
+    // 请求状态在连接关闭时以TCP_CONN_CLOSED释放
+    if (tcp_connect_closing(conn->tcp)) {
+        return;
+    }
+    for (int budget = HTTP_CONN_BUDGET;; budget--) {
+        if (budget == 0) {
+            http_ready_push(conn);
+            return;
+        }
 
-        /*
-        1、调用get_line从rx_buffer中获取一行数据，如果没有数据，则调用close_http关闭tcp，并继续循环
-        */
+        if (conn->stream) {
+            int keep_alive = conn->stream->keep_alive;
+            if (http_stream_run(conn)) {
+                return;
+            }
+            if (!keep_alive) {
+                close_http(conn);
+                return;
+            }
+            net_timer_set(&conn->idle_timer, HTTP_KEEPALIVE_TIMEOUT_SEC * 1000, http_idle_timeout, conn);
+        }
 
-       // TODO
+        // 丢弃上一个请求的请求体
+        if (conn->body_left) {
+            conn->body_left -= tcp_connect_discard(conn->tcp, conn->body_left);
+            if (conn->body_left) {
+                if (conn->peer_closed) {
+                    close_http(conn);
+                }
+                return;
+            }
+        }
 
+        // 对端已经关闭时不会再有数据，没有完整的请求了就在已经排队的响应之后关闭
+        size_t head_len = conn->head_len ? conn->head_len : http_head_scan(conn);
+        if (head_len == 0) {
+            if (conn->scan >= HTTP_HEAD_MAX || conn->peer_closed) {
+                close_http(conn);
+            }
+            return;
+        }
+        if (head_len > HTTP_HEAD_MAX) {
+            close_http(conn);
+            return;
+        }
+        if (!tcp_connect_writable(conn->tcp, HTTP_RESPONSE_HEAD_MAX)) {
+            return;
+        }
+
+        // 请求头通常是连续的，直接在rx_buf里解析；绕回时才拼接到http_head_buf中
+        size_t n = head_len;
+        const char* head = (const char*)tcp_connect_peek(conn->tcp, 0, &n);
+        if (n < head_len) {
+            memcpy(http_head_buf, head, n);
+            size_t rest = head_len - n;
+            memcpy(http_head_buf + n, tcp_connect_peek(conn->tcp, n, &rest), rest);
+            head = http_head_buf;
+        }
 
         /*
-        2、检查是否有GET请求，如果没有，则调用close_http关闭tcp，并继续循环
+        检查是否有GET请求，如果没有，则调用close_http关闭连接
         */
+        http_request_t req;
+        if (http_parse(head, head_len, &req) != 0 || req.method_len != 3 || memcmp(req.method, "GET", 3) != 0) {
+            close_http(conn);
+            return;
+        }
 
-       // TODO
-
+        /*
+        HTTP/1.1默认是持久连接，HTTP/1.0要明确要求；请求数达到上限后这个响应之后关闭
+        请求体按Content-Length跳过
+        */
+        const http_header_t* connection = http_header_get(&req, "Connection");
+        int keep_alive = connection ? !http_header_has_token(connection, "close") &&
+            (req.minor_version >= 1 || http_header_has_token(connection, "keep-alive")) : req.minor_version >= 1;
+        if (++conn->requests >= HTTP_MAX_KEEPALIVE_REQUESTS) {
+            keep_alive = 0;
+        }
+        const http_header_t* content_length = http_header_get(&req, "Content-Length");
+        conn->body_left = 0;
+        if (content_length) {
+            for (size_t i = 0; i < content_length->value_len; i++) {
+                if (content_length->value[i] < '0' || content_length->value[i] > '9' || conn->body_left > UINT32_MAX) {
+                    close_http(conn);
+                    return;
+                }
+                conn->body_left = conn->body_left * 10 + content_length->value[i] - '0';
+            }
+        }
 
         /*
-        3、解析GET请求的路径，注意跳过空格，找到GET请求的文件，调用send_file发送文件
+        有处理函数的路径交给处理函数流式产生响应，否则调用send_file发送文件，不是持久连接则随后关闭
         */
+        const http_route_t* route = http_route_find(req.path, req.path_len);
+        if (route) {
+            if (http_stream_new(conn, route, &req, keep_alive) != 0) {
+                close_http(conn);
+                return;
+            }
+        } else {
+            char url[HTTP_HEAD_MAX];
+            memcpy(url, req.path, req.path_len);
+            url[req.path_len] = '\0';
+            send_file(conn->tcp, &req, url, keep_alive);
+        }
+        tcp_connect_discard(conn->tcp, head_len);
+        conn->scan = conn->last_nl = conn->head_len = 0;
+        if (conn->stream) {
+            net_timer_cancel(&conn->idle_timer);
+            continue;
+        }
+        if (!keep_alive) {
+            close_http(conn);
+            return;
+        }
+        net_timer_set(&conn->idle_timer, HTTP_KEEPALIVE_TIMEOUT_SEC * 1000, http_idle_timeout, conn);
+    }
+}
+
+static void http_handler(tcp_connect_t* tcp, connect_state_t state) {
+    http_conn_t* conn = tcp->app;
+    if (state == TCP_CONN_CONNECTED) {
+        conn = calloc(1, sizeof(http_conn_t));
+        if (conn == NULL) {
+            tcp_connect_close(tcp);
+            return;
+        }
+        conn->tcp = tcp;
+        tcp->app = conn;
+        net_timer_set(&conn->idle_timer, HTTP_KEEPALIVE_TIMEOUT_SEC * 1000, http_idle_timeout, conn);
+    } else if (state == TCP_CONN_DATA_RECV || state == TCP_CONN_DATA_SENT) {
+        if (conn) {
+            if (conn->stream == NULL) {
+                net_timer_set(&conn->idle_timer, HTTP_KEEPALIVE_TIMEOUT_SEC * 1000, http_idle_timeout, conn);
+            }
+            http_conn_run(conn);
+        }
+    } else if (state == TCP_CONN_PEER_CLOSED) {
+        // 对端半关闭，rx_buf中流水线发来的请求照常处理完再关闭
+        if (conn) {
+            conn->peer_closed = 1;
+            http_conn_run(conn);
+        }
+    } else if (state == TCP_CONN_CLOSED) {
+        // 对端关闭或者复位时请求状态还在，这里释放；已经close_http的连接app为NULL
+        if (conn) {
+            tcp->app = NULL;
+            http_conn_free(conn);
+        }
+    } else {
+        assert(0);
+    }
+}
 
-       // TODO
 
+// 在端口上创建服务器。
 
-        /*
-        4、调用close_http关掉连接
-        */
+int http_server_open(uint16_t port) {
+    if (tcp_open(port, http_handler) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-       // TODO
+// 注册动态处理函数，路径以prefix开头的请求交给它，有多个匹配时取最长的前缀。
 
+int http_route(const char* prefix, http_route_handler_t handler, void* arg) {
+    if (http_route_count == HTTP_MAX_ROUTES || prefix[0] != '/') {
+        return -1;
+    }
+    http_route_t* route = &http_routes[http_route_count];
+    route->prefix = strdup(prefix);
+    if (route->prefix == NULL) {
+        return -1;
+    }
+    route->prefix_len = strlen(prefix);
+    route->handler = handler;
+    route->arg = arg;
+    http_route_count++;
+    return 0;
+}
 
-        printf("!! final close\n");
+// 在主循环中给就绪队列中的连接各一轮处理额度，这一轮中重新排队的连接留到下一次。
+
+void http_server_run(void) {
+    for (size_t n = http_ready.count; n > 0 && http_ready.head; n--) {
+        http_conn_run(http_ready.head);
     }
 }
@@ -0,0 +1,360 @@
+#include "http_cache.h"
+#include "http.h"
+#include "config.h"
+#include "timer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define HTTP_CACHE_TABLE_MIN_SIZE 64 // 缓存哈希表初始桶数
+
+/* Http_cache以请求路径和内容编码为键缓存小的静态文件，命中且不需要核对时不进行任何文件系统调用。
+    条目单独分配，桶内用hash_next串成链表，条目数超过桶数时桶数翻倍；
+    所有条目按使用时间串成LRU链表，占用的内存超过HTTP_CACHE_BUDGET时从最久没有使用的一端淘汰。
+    被淘汰或者失效的条目可能还在某些连接的发送队列中，等refs降为0再释放。
+*/
+static struct {
+    http_cache_entry_t** buckets;
+    uint32_t mask;                      // 桶数-1，桶数为2的幂
+    size_t count;                       // 条目数
+    size_t bytes;                       // 所有条目的cost之和
+    http_cache_entry_t *lru_head, *lru_tail; // lru_head是最近使用的
+} http_cache;
+
+static const struct {
+    const char* ext;
+    const char* type;
+} http_content_types[] = {
+    {".html", "text/html"},
+    {".htm", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".json", "application/json"},
+    {".txt", "text/plain"},
+    {".xml", "text/xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".svg", "image/svg+xml"},
+    {".ico", "image/x-icon"},
+    {".pdf", "application/pdf"},
+};
+
+/**
+ * @brief 按扩展名确定Content-Type
+ *
+ * @param path
+ * @return const char* 不认识的扩展名为application/octet-stream
+ */
+const char* http_content_type(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (dot && strchr(dot, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(http_content_types) / sizeof(http_content_types[0]); i++) {
+            if (strcmp(dot, http_content_types[i].ext) == 0)
+                return http_content_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * @brief 由文件的修改时间和长度生成ETag和Last-Modified
+ *
+ * @param mtime
+ * @param len
+ * @param etag 输出，至少HTTP_ETAG_MAX字节
+ * @param last_modified 输出，至少HTTP_DATE_MAX字节
+ */
+void http_validators(time_t mtime, uint64_t len, char* etag, char* last_modified) {
+    snprintf(etag, HTTP_ETAG_MAX, "\"%llx-%llx\"", (unsigned long long)mtime, (unsigned long long)len);
+    struct tm* tm = gmtime(&mtime);
+    if (tm == NULL || strftime(last_modified, HTTP_DATE_MAX, "%a, %d %b %Y %H:%M:%S GMT", tm) == 0)
+        last_modified[0] = '\0';
+}
+
+/**
+ * @brief 生成只和文件有关的响应头，不含状态行、Content-Length、Connection和结尾的空行，
+ *        200、206和304响应都带上这些头，缓存的条目和直接从文件发送的响应使用同样的格式。
+ *        同一个路径可能按Accept-Encoding返回不同的内容，所以总是带上Vary
+ *
+ * @param buf
+ * @param size
+ * @param path 请求路径，用于确定Content-Type
+ * @param encoding 内容编码，原文件为NULL
+ * @param etag
+ * @param last_modified
+ * @return int 写入的长度，放不下时为负
+ */
+int http_head_format(char* buf, size_t size, const char* path, const char* encoding, const char* etag, const char* last_modified) {
+    int n = snprintf(buf, size, "Content-Type: %s\r\n%s%s%sVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+        http_content_type(path), encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "",
+        etag, last_modified);
+    return n < 0 || (size_t)n >= size ? -1 : n;
+}
+
+/**
+ * @brief 计算请求路径和内容编码的哈希值(FNV-1a)
+ *
+ * @param path
+ * @param encoding 可以为NULL
+ * @return uint32_t
+ */
+static uint32_t http_cache_hash(const char* path, const char* encoding) {
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    h = (h ^ '\n') * 16777619u;
+    while (encoding && *encoding)
+        h = (h ^ (uint8_t)*encoding++) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief 释放条目的内存
+ *
+ * @param entry
+ */
+static void http_cache_entry_free(http_cache_entry_t* entry) {
+    free(entry->path);
+    free(entry->body);
+    free(entry->sums);
+    free(entry->head);
+    free(entry);
+}
+
+/**
+ * @brief 把条目移出哈希表和LRU链表，还有引用时只做标记，等引用释放后再释放内存
+ *
+ * @param entry
+ */
+static void http_cache_evict(http_cache_entry_t* entry) {
+    http_cache_entry_t** pp = &http_cache.buckets[entry->hash & http_cache.mask];
+    while (*pp != entry)
+        pp = &(*pp)->hash_next;
+    *pp = entry->hash_next;
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        http_cache.lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        http_cache.lru_tail = entry->lru_prev;
+    http_cache.count--;
+    http_cache.bytes -= entry->cost;
+    if (entry->refs)
+        entry->evicted = 1;
+    else
+        http_cache_entry_free(entry);
+}
+
+/**
+ * @brief 把条目移到LRU链表的最近使用端
+ *
+ * @param entry
+ */
+static void http_cache_touch(http_cache_entry_t* entry) {
+    if (http_cache.lru_head == entry)
+        return;
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else if (entry->lru_prev)
+        http_cache.lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = http_cache.lru_head;
+    if (http_cache.lru_head)
+        http_cache.lru_head->lru_prev = entry;
+    http_cache.lru_head = entry;
+    if (http_cache.lru_tail == NULL)
+        http_cache.lru_tail = entry;
+}
+
+/**
+ * @brief 把哈希表的桶数翻倍并重新挂链，分配失败时保持原样
+ *
+ */
+static void http_cache_grow() {
+    uint32_t size = (http_cache.mask + 1) * 2;
+    http_cache_entry_t** buckets = calloc(size, sizeof(http_cache_entry_t*));
+    if (buckets == NULL)
+        return;
+    for (uint32_t i = 0; i <= http_cache.mask; i++) {
+        http_cache_entry_t* entry = http_cache.buckets[i];
+        while (entry) {
+            http_cache_entry_t* next = entry->hash_next;
+            entry->hash_next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(http_cache.buckets);
+    http_cache.buckets = buckets;
+    http_cache.mask = size - 1;
+}
+
+/**
+ * @brief 查找请求路径的某种编码对应的缓存条目。距上次核对超过HTTP_CACHE_CHECK_MS时stat一次文件，
+ *        修改时间、长度或inode变了，或者原来不存在的旁路文件出现了，就让条目失效，
+ *        因此热点文件每个周期最多一次stat
+ *
+ * @param path 请求路径
+ * @param encoding 内容编码，原文件为NULL
+ * @param file_path 对应的文件路径
+ * @return http_cache_entry_t* 没有缓存或者已经失效为NULL；missing的条目表示文件不存在
+ */
+http_cache_entry_t* http_cache_lookup(const char* path, const char* encoding, const char* file_path) {
+    if (http_cache.buckets == NULL)
+        return NULL;
+    uint32_t hash = http_cache_hash(path, encoding);
+    http_cache_entry_t* entry = http_cache.buckets[hash & http_cache.mask];
+    while (entry && !(entry->hash == hash && entry->encoding == encoding && strcmp(entry->path, path) == 0))
+        entry = entry->hash_next;
+    if (entry == NULL)
+        return NULL;
+
+    uint64_t now = net_time_ms();
+    if (now - entry->checked >= HTTP_CACHE_CHECK_MS) {
+        struct stat st;
+        int exists = stat(file_path, &st) == 0 && S_ISREG(st.st_mode);
+        if (entry->missing ? exists : (!exists || st.st_mtime != entry->mtime ||
+            (uint64_t)st.st_size != entry->size || st.st_ino != entry->ino)) {
+            http_cache_evict(entry);
+            return NULL;
+        }
+        entry->checked = now;
+    }
+    http_cache_touch(entry);
+    return entry;
+}
+
+/**
+ * @brief 分配一个条目并复制键
+ *
+ * @param path
+ * @param encoding
+ * @return http_cache_entry_t* 失败为NULL
+ */
+static http_cache_entry_t* http_cache_entry_new(const char* path, const char* encoding) {
+    if (http_cache.buckets == NULL) {
+        http_cache.buckets = calloc(HTTP_CACHE_TABLE_MIN_SIZE, sizeof(http_cache_entry_t*));
+        if (http_cache.buckets == NULL)
+            return NULL;
+        http_cache.mask = HTTP_CACHE_TABLE_MIN_SIZE - 1;
+    }
+    http_cache_entry_t* entry = calloc(1, sizeof(http_cache_entry_t));
+    if (entry == NULL)
+        return NULL;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->encoding = encoding;
+    entry->hash = http_cache_hash(path, encoding);
+    entry->checked = net_time_ms();
+    entry->cost = sizeof(http_cache_entry_t) + strlen(path) + 1;
+    return entry;
+}
+
+/**
+ * @brief 把新条目加入哈希表和LRU链表的最近使用端，必要时淘汰最久没有使用的条目
+ *
+ * @param entry
+ */
+static void http_cache_link(http_cache_entry_t* entry) {
+    if (http_cache.count > http_cache.mask)
+        http_cache_grow();
+    http_cache_entry_t** bucket = &http_cache.buckets[entry->hash & http_cache.mask];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    http_cache_touch(entry);
+    http_cache.count++;
+    http_cache.bytes += entry->cost;
+    while (http_cache.bytes > HTTP_CACHE_BUDGET && http_cache.lru_tail != entry)
+        http_cache_evict(http_cache.lru_tail);
+}
+
+/**
+ * @brief 读入已经打开的文件并加入缓存，同时按块算好部分校验和，必要时淘汰最久没有使用的条目。
+ *        超过HTTP_CACHE_FILE_MAX的文件不缓存，由调用者直接从文件发送
+ *
+ * @param path 请求路径
+ * @param encoding 内容编码，原文件为NULL，必须是常量字符串，查找时按地址比较
+ * @param fd 刚打开的文件，从头读起，不关闭
+ * @param st fd的fstat结果
+ * @return http_cache_entry_t* 不缓存或者失败为NULL
+ */
+http_cache_entry_t* http_cache_insert(const char* path, const char* encoding, int fd, const struct stat* st) {
+    if ((uint64_t)st->st_size > HTTP_CACHE_FILE_MAX)
+        return NULL;
+    http_cache_entry_t* entry = http_cache_entry_new(path, encoding);
+    if (entry == NULL)
+        return NULL;
+    char head[HTTP_RESPONSE_HEAD_MAX];
+    http_validators(st->st_mtime, st->st_size, entry->etag, entry->last_modified);
+    int head_len = http_head_format(head, sizeof(head), path, encoding, entry->etag, entry->last_modified);
+    if (head_len < 0) {
+        http_cache_entry_free(entry);
+        return NULL;
+    }
+    entry->size = st->st_size;
+    entry->head = malloc(head_len);
+    entry->body = malloc(entry->size ? entry->size : 1);
+    entry->sums = malloc((entry->size / TCP_SUM_BLOCK + 1) * sizeof(uint32_t));
+    if (entry->head == NULL || entry->body == NULL || entry->sums == NULL) {
+        http_cache_entry_free(entry);
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < entry->size) {
+        long n = read(fd, entry->body + done, entry->size - done);
+        if (n <= 0) {
+            http_cache_entry_free(entry);
+            return NULL;
+        }
+        done += n;
+    }
+    for (size_t i = 0; i < entry->size; i += TCP_SUM_BLOCK)
+        entry->sums[i / TCP_SUM_BLOCK] = checksum_add(entry->body + i, entry->size - i < TCP_SUM_BLOCK ? entry->size - i : TCP_SUM_BLOCK, 0);
+    memcpy(entry->head, head, head_len);
+    entry->head_len = head_len;
+    entry->mtime = st->st_mtime;
+    entry->ino = st->st_ino;
+    entry->cost += entry->size + head_len + (entry->size / TCP_SUM_BLOCK + 1) * sizeof(uint32_t);
+    http_cache_link(entry);
+    return entry;
+}
+
+/**
+ * @brief 记下某个路径的旁路文件不存在，之后的请求直接按原文件处理，直到核对时发现文件出现
+ *
+ * @param path 请求路径
+ * @param encoding 旁路文件的内容编码，必须是常量字符串
+ */
+void http_cache_insert_missing(const char* path, const char* encoding) {
+    http_cache_entry_t* entry = http_cache_entry_new(path, encoding);
+    if (entry == NULL)
+        return;
+    entry->missing = 1;
+    http_cache_link(entry);
+}
+
+/**
+ * @brief 发送队列不再引用条目的内容，作为tcp_connect_send_ref的release回调
+ *
+ * @param arg 缓存条目
+ */
+void http_cache_release(void* arg) {
+    http_cache_entry_t* entry = arg;
+    if (--entry->refs == 0 && entry->evicted)
+        http_cache_entry_free(entry);
+}
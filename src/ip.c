@@ -16,17 +16,13 @@ void ip_in(buf_t *buf, uint8_t *src_mac)
     // Step1: 如果数据包的长度小于 IP 头部长度，丢弃不处理
     if (buf->len < sizeof(ip_hdr_t)) return;
 
-    // Step2: 创建备份，便于发送ICMP协议不可达信息
-    buf_t copy;
-    buf_copy(&copy, buf, buf->len);
-
-    // Step3: 进行报头检测，检测内容包括版本号是否为 IPv4 、总长度字段是否小于等于收到的包的长度等
+    // Step2: 进行报头检测，检测内容包括版本号是否为 IPv4 、总长度字段是否小于等于收到的包的长度等
     // 如果不符合这些要求，则丢弃不处理
     ip_hdr_t *hdr = (ip_hdr_t *) buf->data;
     if (hdr->version != IP_VERSION_4) return;
     if (swap16(hdr->total_len16) > buf->len) return;
 
-    // Step4: 先把 IP 头部的头部校验和字段用其它变量保存起来，接着将该头部校验和字段置 0
+    // Step3: 先把 IP 头部的头部校验和字段用其它变量保存起来，接着将该头部校验和字段置 0
     // 然后调用 checksum16 函数来计算头部校验和。如果不一致，丢弃不处理；如果一致，恢复头部校验和字段为原来的值
     uint16_t hdr_checksum16_backup = hdr->hdr_checksum16;
     hdr->hdr_checksum16 = 0;
@@ -34,22 +30,26 @@ void ip_in(buf_t *buf, uint8_t *src_mac)
     if (hdr_checksum16 != hdr_checksum16_backup) return;
     hdr->hdr_checksum16 = hdr_checksum16_backup;
 
-    // Step5: 对比目的 IP 地址是否为本机 IP 地址，如果不是，则丢弃不处理
+    // Step4: 对比目的 IP 地址是否为本机 IP 地址，如果不是，则丢弃不处理
     if (memcmp(hdr->dst_ip, net_if_ip, NET_IP_LEN) != 0) return;
 
-    // Step6: 如果数据包长度大于 IP 头部的总长度字段，说明该数据包有填充字段，可调用 buf_remove_padding 函数去除填充字段
+    // Step5: 如果数据包长度大于 IP 头部的总长度字段，说明该数据包有填充字段，可调用 buf_remove_padding 函数去除填充字段
     if (buf->len > swap16(hdr->total_len16)) buf_remove_padding(buf, buf->len - swap16(hdr->total_len16));
 
-    // Step7: 调用 buf_remove_header 函数去除 IP 报头
+    // Step6: 调用 buf_remove_header 函数去除 IP 报头
     uint8_t protocol = hdr->protocol;
     uint8_t *src_ip = hdr->src_ip;
     buf_remove_header(buf, hdr->hdr_len * 4);
 
-    // Step8: 调用 net_in 函数向上层传递数据包
+    // Step7: 调用 net_in 函数向上层传递数据包
     // 如果是不能识别的协议类型，则调用 icmp_unreachable 函数返回ICMP协议不可达信息。
+    // 这时上层没有处理过数据包，IP 头部还在 buf 前面，加回来即可，不需要事先备份整个数据包
     int flag = net_in(buf, protocol, src_ip);
     if (flag == -1)
-        icmp_unreachable(&copy, src_ip, ICMP_CODE_PROTOCOL_UNREACH);
+    {
+        buf_add_header(buf, hdr->hdr_len * 4);
+        icmp_unreachable(buf, src_ip, ICMP_CODE_PROTOCOL_UNREACH);
+    }
 }
 
 /**
@@ -101,12 +101,20 @@ void ip_fragment_out(buf_t *buf, uint8_t *ip, net_protocol_t protocol, int id, u
 void ip_out(buf_t *buf, uint8_t *ip, net_protocol_t protocol)
 {
     // TO-DO
-    // Step1: 求出IP协议最大负载包长（1500字节，即MTU大小，减去IP首部长度）
-    int max_load_length = 1500 - sizeof(ip_hdr_t);
+    // Step1: 求出IP协议最大负载包长（MTU大小减去IP首部长度）
+    int max_load_length = ETHERNET_MAX_TRANSPORT_UNIT - sizeof(ip_hdr_t);
 
     // Step2: 如果数据包长度超过IP协议的最大负载包长，则需要分片发送
     int i;
     static int id = 0;
+    if (buf->gso_size)
+    {
+        // TCP超级段不分片，也不复制，加上一个IP头后交给以太网层切分，切出的每个段依次使用一个id
+        int segs = buf->len / buf->gso_size + 1;
+        ip_fragment_out(buf, ip, protocol, id, 0, 0);
+        id += segs;
+        return;
+    }
     for (i = 0; (i + 1) * max_load_length < buf->len; i++)
     {
         buf_t ip_buf;
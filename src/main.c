@@ -23,6 +23,10 @@ void udp_handler(uint8_t* data, size_t len, uint8_t* src_ip, uint16_t src_port)
 
 #ifdef TCP
 void tcp_handler(tcp_connect_t* connect, connect_state_t state) {
+    if (state == TCP_CONN_PEER_CLOSED) {
+        tcp_connect_close(connect); //对端关闭后回显完已经收到的数据即可关闭
+        return;
+    }
     uint8_t buf[512];
     size_t len = tcp_connect_read(connect, buf, sizeof(buf) - 1);
     buf[len] = 0;
@@ -33,6 +37,39 @@ void tcp_handler(tcp_connect_t* connect, connect_state_t state) {
 }
 #endif
 
+#ifdef HTTP
+// 以流式响应输出tcp的统计计数，ctx记录已经写出的行数
+http_stream_status_t http_stats_handler(http_stream_t* stream) {
+    static const struct {
+        const char* name;
+        const uint64_t* value;
+    } stats[] = {
+        {"syn_queue_overflows", &tcp_stats.syn_queue_overflows},
+        {"syncookies_ok", &tcp_stats.syncookies_ok},
+        {"syncookies_failed", &tcp_stats.syncookies_failed},
+        {"listen_overflows", &tcp_stats.listen_overflows},
+        {"retransmitted_segs", &tcp_stats.retransmitted_segs},
+        {"fast_retransmits", &tcp_stats.fast_retransmits},
+        {"partial_ack_retransmits", &tcp_stats.partial_ack_retransmits},
+        {"rto_timeouts", &tcp_stats.rto_timeouts},
+        {"recoveries", &tcp_stats.recoveries},
+        {"timewait_overflows", &tcp_stats.timewait_overflows},
+        {"timewait_recycled", &tcp_stats.timewait_recycled},
+        {"reaped_connections", &tcp_stats.reaped_connections},
+        {"paws_rejected", &tcp_stats.paws_rejected},
+    };
+    if (stream->aborted)
+        return HTTP_STREAM_DONE;
+    for (size_t i = (size_t)stream->ctx; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        if (http_stream_printf(stream, "%s %llu\n", stats[i].name, (unsigned long long)*stats[i].value) < 0) {
+            stream->ctx = (void*)i;
+            return HTTP_STREAM_MORE;
+        }
+    }
+    return HTTP_STREAM_DONE;
+}
+#endif
+
 int main(int argc, char const *argv[])
 {
 
@@ -49,6 +86,7 @@ int main(int argc, char const *argv[])
 #endif
 #ifdef HTTP
     http_server_open(62000);
+    http_route("/stats", http_stats_handler, NULL);
 #endif
     while (1) 
 	{
@@ -6,6 +6,7 @@
 #include "icmp.h"
 #include "udp.h"
 #include "tcp.h"
+#include "timer.h"
 
 /**
  * @brief 协议表 <协议号,处理程序>的容器
@@ -38,6 +39,7 @@ buf_t rxbuf, txbuf; //一个buf足够单线程使用
 int net_init()
 {
     map_init(&net_table, sizeof(uint16_t), sizeof(net_handler_t), 0, 0, NULL);
+    net_timer_init();
     if (driver_open() == -1)
         return -1;
 #ifdef ETHERNET
@@ -100,4 +102,5 @@ void net_poll()
 #ifdef ETHERNET
     ethernet_poll();
 #endif
+    net_timer_poll();
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include <string.h>
+#include "ringbuf.h"
+
+/**
+ * @brief 初始化环形缓冲区并分配空间
+ * 
+ * @param rb 要初始化的缓冲区
+ * @param size 容量，会被向上取整为2的幂
+ * @return int 成功为0，失败为-1
+ */
+int ringbuf_init(ringbuf_t *rb, uint32_t size)
+{
+    uint32_t cap = 1;
+    while (cap < size)
+        cap <<= 1;
+    rb->data = malloc(cap);
+    rb->size = rb->data ? cap : 0;
+    rb->head = 0;
+    rb->tail = 0;
+    return rb->data ? 0 : -1;
+}
+
+/**
+ * @brief 释放环形缓冲区的空间
+ * 
+ * @param rb 要释放的缓冲区
+ */
+void ringbuf_free(ringbuf_t *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+/**
+ * @brief 向缓冲区尾部写入数据，空间不足时只写入能放下的部分
+ * 
+ * @param rb 要写入的缓冲区
+ * @param data 数据
+ * @param len 数据长度
+ * @return uint32_t 实际写入的字节数
+ */
+uint32_t ringbuf_write(ringbuf_t *rb, const void *data, uint32_t len)
+{
+    uint32_t space = ringbuf_space(rb);
+    if (len > space)
+        len = space;
+    uint32_t pos = rb->tail & (rb->size - 1);
+    uint32_t first = rb->size - pos;
+    if (first > len)
+        first = len;
+    memcpy(rb->data + pos, data, first);
+    memcpy(rb->data, (const uint8_t *)data + first, len - first);
+    rb->tail += len;
+    return len;
+}
+
+/**
+ * @brief 从有效数据的offset处拷贝数据，不移动读位置
+ * 
+ * @param rb 要读取的缓冲区
+ * @param offset 相对读位置的偏移
+ * @param data 输出缓冲
+ * @param len 想要读取的长度
+ * @return uint32_t 实际拷贝的字节数
+ */
+uint32_t ringbuf_peek(const ringbuf_t *rb, uint32_t offset, void *data, uint32_t len)
+{
+    uint32_t avail = ringbuf_len(rb);
+    if (offset >= avail)
+        return 0;
+    if (len > avail - offset)
+        len = avail - offset;
+    uint32_t pos = (rb->head + offset) & (rb->size - 1);
+    uint32_t first = rb->size - pos;
+    if (first > len)
+        first = len;
+    memcpy(data, rb->data + pos, first);
+    memcpy((uint8_t *)data + first, rb->data, len - first);
+    return len;
+}
+
+/**
+ * @brief 丢弃头部的数据
+ * 
+ * @param rb 要操作的缓冲区
+ * @param len 丢弃的长度
+ * @return uint32_t 实际丢弃的字节数
+ */
+uint32_t ringbuf_discard(ringbuf_t *rb, uint32_t len)
+{
+    uint32_t avail = ringbuf_len(rb);
+    if (len > avail)
+        len = avail;
+    rb->head += len;
+    return len;
+}
+
+/**
+ * @brief 从缓冲区头部读取并移除数据
+ * 
+ * @param rb 要读取的缓冲区
+ * @param data 输出缓冲
+ * @param len 想要读取的长度
+ * @return uint32_t 实际读取的字节数
+ */
+uint32_t ringbuf_read(ringbuf_t *rb, void *data, uint32_t len)
+{
+    len = ringbuf_peek(rb, 0, data, len);
+    rb->head += len;
+    return len;
+}
+
+/**
+ * @brief 取得有效数据offset处连续存放的一段数据的地址，不拷贝，用于边复制边计算
+ * 
+ * @param rb 要读取的缓冲区
+ * @param offset 相对读位置的偏移
+ * @param len 输入想要的长度，输出从返回地址开始实际连续可读的长度
+ * @return const uint8_t* 数据地址，offset超出有效数据时len为0
+ */
+const uint8_t *ringbuf_span(const ringbuf_t *rb, uint32_t offset, uint32_t *len)
+{
+    uint32_t avail = ringbuf_len(rb);
+    uint32_t pos = (rb->head + offset) & (rb->size - 1);
+    if (offset >= avail)
+        avail = offset;
+    if (*len > avail - offset)
+        *len = avail - offset;
+    if (*len > rb->size - pos)
+        *len = rb->size - pos;
+    return rb->data + pos;
+}
@@ -1,5 +1,11 @@
 #include <assert.h>
-#include "map.h"
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "tcp.h"
 #include "ip.h"
 
@@ -9,6 +15,9 @@ static void panic(const char* msg, int line) {
 }
 
 static void display_flags(tcp_flags_t flags) {
+#ifdef NET_QUIET
+    (void)flags;
+#else
     printf("flags:%s%s%s%s%s%s%s%s\n",
         flags.cwr ? " cwr" : "",
         flags.ece ? " ece" : "",
@@ -19,208 +28,1858 @@ static void display_flags(tcp_flags_t flags) {
         flags.syn ? " syn" : "",
         flags.fin ? " fin" : ""
     );
+#endif
 }
 
-// dst-port -> handler
-static map_t tcp_table; //tcp_table里面放了一个dst_port的回调函数
+// dst-port -> tcp_listener_t, 按端口号直接索引
+static tcp_listener_t* tcp_table[UINT16_MAX + 1];
 
-// tcp_key_t[IP, src port, dst port] -> tcp_connect_t
+/* Connect_table放置了一堆TCP连接，是以tcp_key_t[远端IP，本端IP，远端端口，本端端口]为键的哈希表。
+    tcp_connect_t单独分配，桶内用hash_next串成链表；连接数超过桶数时桶数翻倍，收包时的查找是O(1)的。
+*/
+static struct {
+    tcp_connect_t** buckets;
+    uint32_t mask; // 桶数-1，桶数为2的幂
+    size_t size;   // 连接数
+    uint32_t seed; // 哈希种子，防止对端刻意构造冲突
+} connect_table;
+
+#define TCP_CONNECT_TABLE_MIN_SIZE 1024 //连接表初始桶数
+#define TCP_SYN_TABLE_SIZE 4096         //半连接表桶数
+
+/* Syn_table放置收到SYN但还没有完成握手的半连接，同样以tcp_key_t为键。
+    每个端口的半连接数受tcp_listener_t.syn_queue_len限制，超出后改用SYN cookie，不再占用内存。
+*/
+static struct {
+    tcp_syn_entry_t* buckets[TCP_SYN_TABLE_SIZE];
+    tcp_syn_entry_t *oldest, *newest; // 按创建时间排列的链表
+} syn_table;
+
+#define TCP_TW_NIL UINT32_MAX        // timewait池中的空下标
+#define TCP_TW_SLOTS TCP_TIMEWAIT_SEC // 时间轮每格1秒，转一圈正好是2MSL
+#define TCP_TW_TABLE_MIN_SIZE 1024   // timewait表初始桶数和池容量
+
+/* Tw_table放置TIME_WAIT状态的连接，同样以tcp_key_t为键。
+    条目放在一个按需扩容的数组中，用32位下标代替指针串成链表，每个条目只占32字节。
+    数组前TCP_TW_SLOTS个元素是时间轮各格的哨兵，一个每秒触发一次的定时器每次释放一格中的所有条目。
+*/
+static struct {
+    tcp_timewait_t* pool;
+    uint32_t capacity; // pool的长度
+    uint32_t free;     // 空闲条目链表，用next串起来
+    uint32_t* buckets;
+    uint32_t mask;     // 桶数-1，桶数为2的幂
+    size_t count;      // 条目数
+    uint32_t tick;     // 时间轮当前格
+    net_timer_t timer;
+} tw_table;
+
+#define TCP_COOKIE_MASK 0x00FFFFFF // cookie低24位为MSS编号与哈希之和，高8位为计数器
+#define TCP_COOKIE_MAX_AGE 2       // 计数器每64秒加一，cookie在2个周期内有效
+static const uint16_t tcp_cookie_mss[] = { 536, 1220, 1440, 1460 };
+
+static uint64_t tcp_secret[4]; // 0、1用于SYN cookie，2用于生成初始序号，3用于生成时间戳偏移
+
+tcp_stats_t tcp_stats;
+
+static uint16_t tcp_port_cursor; // 下一次分配临时端口时开始尝试的位置
+
+static tcp_connect_t* tcp_notifying; // 正在回调的连接，回调中写入的数据等回调返回后再统一发送
+
+/**
+ * @brief 生成一个用于 connect_table 的 key
+ *
+ * @param ip 远端IP
+ * @param local_ip 本端IP
+ * @param src_port 远端端口
+ * @param dst_port 本端端口
+ * @return tcp_key_t
+ */
+static tcp_key_t new_tcp_key(uint8_t ip[NET_IP_LEN], uint8_t local_ip[NET_IP_LEN], uint16_t src_port, uint16_t dst_port) {
+    tcp_key_t key;
+    memcpy(key.ip, ip, NET_IP_LEN);
+    memcpy(key.local_ip, local_ip, NET_IP_LEN);
+    key.src_port = src_port;
+    key.dst_port = dst_port;
+    return key;
+}
+
+/**
+ * @brief 以seed为密钥计算四元组的哈希值
+ *
+ * @param key
+ * @param seed
+ * @return uint32_t
+ */
+static uint32_t tcp_hash(const tcp_key_t* key, uint64_t seed) {
+    uint32_t words[3];
+    memcpy(words, key, sizeof(words));
+    uint64_t h = seed;
+    for (int i = 0; i < 3; i++) {
+        h = (h ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 32;
+    }
+    return (uint32_t)h;
+}
+
+/**
+ * @brief 计算四元组在 connect_table 和 syn_table 中的哈希值
+ *
+ * @param key
+ * @return uint32_t
+ */
+static uint32_t tcp_key_hash(const tcp_key_t* key) {
+    return tcp_hash(key, connect_table.seed);
+}
+
+/**
+ * @brief 判断连接是否属于这个四元组
+ *
+ * @param connect
+ * @param key
+ * @return int
+ */
+static int tcp_key_match(const tcp_connect_t* connect, const tcp_key_t* key) {
+    return connect->remote_port == key->src_port && connect->local_port == key->dst_port &&
+        !memcmp(connect->ip, key->ip, NET_IP_LEN) && !memcmp(connect->local_ip, key->local_ip, NET_IP_LEN);
+}
+
+/**
+ * @brief 在 connect_table 中查找连接
+ *
+ * @param key
+ * @return tcp_connect_t* 找不到为NULL
+ */
+static tcp_connect_t* tcp_connect_lookup(const tcp_key_t* key) {
+    uint32_t hash = tcp_key_hash(key);
+    tcp_connect_t* connect = connect_table.buckets[hash & connect_table.mask];
+    while (connect && !(connect->hash == hash && tcp_key_match(connect, key)))
+        connect = connect->hash_next;
+    return connect;
+}
+
+/**
+ * @brief 把 connect_table 的桶数翻倍并重新挂链，分配失败时保持原样
+ *
+ */
+static void connect_table_grow() {
+    uint32_t size = (connect_table.mask + 1) * 2;
+    tcp_connect_t** buckets = calloc(size, sizeof(tcp_connect_t*));
+    if (buckets == NULL)
+        return;
+    for (uint32_t i = 0; i <= connect_table.mask; i++) {
+        tcp_connect_t* connect = connect_table.buckets[i];
+        while (connect) {
+            tcp_connect_t* next = connect->hash_next;
+            connect->hash_next = buckets[connect->hash & (size - 1)];
+            buckets[connect->hash & (size - 1)] = connect;
+            connect = next;
+        }
+    }
+    free(connect_table.buckets);
+    connect_table.buckets = buckets;
+    connect_table.mask = size - 1;
+}
+
+/**
+ * @brief 新建一个处于LISTEN状态的连接，加入 connect_table 和所属端口的连接链表
+ *
+ * @param key
+ * @param listener 所属的监听端口，可以为NULL
+ * @return tcp_connect_t* 分配失败为NULL
+ */
+static tcp_connect_t* tcp_connect_new(const tcp_key_t* key, tcp_listener_t* listener) {
+    tcp_connect_t* connect = calloc(1, sizeof(tcp_connect_t));
+    if (connect == NULL)
+        return NULL;
+    connect->state = TCP_LISTEN;
+    memcpy(connect->ip, key->ip, NET_IP_LEN);
+    memcpy(connect->local_ip, key->local_ip, NET_IP_LEN);
+    connect->remote_port = key->src_port;
+    connect->local_port = key->dst_port;
+    connect->hash = tcp_key_hash(key);
+    connect->ts_offset = tcp_hash(key, tcp_secret[3]);
+
+    if (connect_table.size > connect_table.mask)
+        connect_table_grow();
+    tcp_connect_t** bucket = &connect_table.buckets[connect->hash & connect_table.mask];
+    connect->hash_next = *bucket;
+    *bucket = connect;
+    connect_table.size++;
+
+    connect->accepted = 1;
+    connect->listener = listener;
+    connect->keepalive_intvl = TCP_KEEPALIVE_INTVL_SEC;
+    connect->keepalive_probes = TCP_KEEPALIVE_PROBES;
+    if (listener) {
+        connect->keepalive_idle = listener->keepalive_idle;
+        connect->keepalive_intvl = listener->keepalive_intvl;
+        connect->keepalive_probes = listener->keepalive_probes;
+        connect->idle_timeout = listener->idle_timeout;
+        connect->port_next = listener->connects;
+        if (listener->connects)
+            listener->connects->port_prev = connect;
+        listener->connects = connect;
+        listener->connect_count++;
+    }
+    return connect;
+}
+
+/**
+ * @brief 初始化tcp的端口表和连接表
+ *        供应用层使用
+ *
+ */
+void tcp_init() {
+    connect_table.buckets = calloc(TCP_CONNECT_TABLE_MIN_SIZE, sizeof(tcp_connect_t*));
+    connect_table.mask = TCP_CONNECT_TABLE_MIN_SIZE - 1;
+    connect_table.size = 0;
+    srand((unsigned)time(NULL));
+    connect_table.seed = (uint32_t)rand();
+    for (int i = 0; i < 4; i++)
+        tcp_secret[i] = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+    tcp_port_cursor = (uint16_t)rand();
+    tw_table.capacity = TCP_TW_SLOTS + TCP_TW_TABLE_MIN_SIZE;
+    tw_table.pool = malloc(tw_table.capacity * sizeof(tcp_timewait_t));
+    for (uint32_t i = 0; i < TCP_TW_SLOTS; i++)
+        tw_table.pool[i].prev = tw_table.pool[i].next = i;
+    tw_table.free = TCP_TW_NIL;
+    for (uint32_t i = tw_table.capacity; i-- > TCP_TW_SLOTS;) {
+        tw_table.pool[i].next = tw_table.free;
+        tw_table.free = i;
+    }
+    tw_table.buckets = malloc(TCP_TW_TABLE_MIN_SIZE * sizeof(uint32_t));
+    memset(tw_table.buckets, 0xFF, TCP_TW_TABLE_MIN_SIZE * sizeof(uint32_t));
+    tw_table.mask = TCP_TW_TABLE_MIN_SIZE - 1;
+    net_add_protocol(NET_PROTOCOL_TCP, tcp_in);
+}
+
+/**
+ * @brief 在 port 上监听，完成握手的连接进入长度为 backlog 的全连接队列，由应用层调用tcp_accept取出
+ *        队列满时不再完成新的握手，对端会重传，以此向对端施加背压
+ *        供应用层使用
+ *
+ * @param port
+ * @param backlog 全连接队列长度
+ * @return tcp_listener_t* 失败为NULL
+ */
+tcp_listener_t* tcp_listen(uint16_t port, size_t backlog) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL) {
+        listener = calloc(1, sizeof(tcp_listener_t));
+        if (listener == NULL)
+            return NULL;
+        listener->port = port;
+        listener->rx_buf_size = TCP_RX_BUF_SIZE;
+        listener->tx_buf_size = TCP_TX_BUF_SIZE;
+        listener->syn_queue_len = TCP_SYN_QUEUE_LEN;
+        listener->keepalive_intvl = TCP_KEEPALIVE_INTVL_SEC;
+        listener->keepalive_probes = TCP_KEEPALIVE_PROBES;
+        tcp_table[port] = listener;
+    }
+    listener->backlog = backlog;
+    return listener;
+}
+
+/**
+ * @brief 从全连接队列中取出一个已建立的连接，队列为空时返回NULL
+ *        取出的连接没有回调函数，应用层可以设置connect->handler接收之后的事件，也可以自行轮询读写
+ *        供应用层使用
+ *
+ * @param listener
+ * @return tcp_connect_t*
+ */
+tcp_connect_t* tcp_accept(tcp_listener_t* listener) {
+    tcp_connect_t* connect = listener->accept_head;
+    if (connect == NULL)
+        return NULL;
+    listener->accept_head = connect->accept_next;
+    if (listener->accept_head)
+        listener->accept_head->accept_prev = NULL;
+    else
+        listener->accept_tail = NULL;
+    listener->accept_count--;
+    connect->accept_next = NULL;
+    connect->accepted = 1;
+    return connect;
+}
+
+/**
+ * @brief 向 port 注册一个 TCP 连接以及关联的回调函数，连接建立后立即以TCP_CONN_CONNECTED回调，不经过tcp_accept
+ *        供应用层使用
+ *
+ * @param port
+ * @param handler
+ * @return int 成功为0，失败为-1
+ */
+int tcp_open(uint16_t port, tcp_handler_t handler) {
+    printf("tcp open\n");
+    tcp_listener_t* listener = tcp_listen(port, TCP_ACCEPT_BACKLOG);
+    if (listener == NULL)
+        return -1;
+    listener->handler = handler;
+    return 0;
+}
+
+/**
+ * @brief 设置 port 上之后建立的连接的收发缓存容量，已有连接不受影响
+ *        供应用层使用
+ *
+ * @param port
+ * @param rx_size 接收缓存容量，会向上取整为2的幂
+ * @param tx_size 发送缓存容量，会向上取整为2的幂
+ * @return int 成功为0，端口未打开为-1
+ */
+int tcp_set_buf_size(uint16_t port, uint32_t rx_size, uint32_t tx_size) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL)
+        return -1;
+    listener->rx_buf_size = rx_size;
+    listener->tx_buf_size = tx_size;
+    return 0;
+}
+
+/**
+ * @brief 设置 port 的半连接队列长度，超出后新的SYN改用SYN cookie应答
+ *        供应用层使用
+ *
+ * @param port
+ * @param len
+ * @return int 成功为0，端口未打开为-1
+ */
+int tcp_set_syn_queue_len(uint16_t port, size_t len) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL)
+        return -1;
+    listener->syn_queue_len = len;
+    return 0;
+}
+
+/**
+ * @brief 设置 port 上之后建立的连接的保活探测：空闲idle_sec秒后每隔intvl_sec秒探测一次，
+ *        连续probes次没有回应则回收连接
+ *        供应用层使用
+ *
+ * @param port
+ * @param idle_sec 0表示不探测
+ * @param intvl_sec
+ * @param probes
+ * @return int 成功为0，端口未打开为-1
+ */
+int tcp_set_keepalive(uint16_t port, uint32_t idle_sec, uint32_t intvl_sec, uint32_t probes) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL)
+        return -1;
+    listener->keepalive_idle = idle_sec;
+    listener->keepalive_intvl = intvl_sec;
+    listener->keepalive_probes = probes;
+    return 0;
+}
+
+/**
+ * @brief 设置 port 上之后建立的连接的空闲超时，超过idle_sec秒没有收到任何报文的连接被回收
+ *        供应用层使用
+ *
+ * @param port
+ * @param idle_sec 0表示不回收
+ * @return int 成功为0，端口未打开为-1
+ */
+int tcp_set_idle_timeout(uint16_t port, uint32_t idle_sec) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL)
+        return -1;
+    listener->idle_timeout = idle_sec;
+    return 0;
+}
+
+/**
+ * @brief 为连接分配收发缓存，之后连接就不再是TCP_LISTEN状态
+ *        rx_buf和tx_buf都是环形缓冲区，容量取自端口的设置，收发数据不需要搬移。
+ *
+ * @param connect
+ * @param listener 端口设置，为NULL时使用默认容量
+ * @param state 新状态
+ * @return int 成功为0，分配失败为-1
+ */
+static int tcp_connect_init_buf(tcp_connect_t* connect, tcp_listener_t* listener, tcp_state_t state) {
+    if (ringbuf_init(&connect->rx_buf, listener ? listener->rx_buf_size : TCP_RX_BUF_SIZE) != 0)
+        return -1;
+    if (ringbuf_init(&connect->tx_buf, listener ? listener->tx_buf_size : TCP_TX_BUF_SIZE) != 0) {
+        ringbuf_free(&connect->rx_buf);
+        return -1;
+    }
+    connect->state = state;
+    return 0;
+}
+
+/**
+ * @brief 释放外部数据的引用：应用层的内存调用release，文件区域解除映射
+ *
+ * @param ext
+ */
+static void tcp_extent_free(tcp_extent_t* ext) {
+    if (ext->release)
+        ext->release(ext->arg);
+#ifndef _WIN32
+    else
+        munmap(ext->map, ext->map_len);
+#endif
+    free(ext);
+}
+
+/**
+ * @brief 发送队列的总长度，包括已发送未确认和尚未发送的数据
+ *
+ * @param connect
+ * @return uint32_t 字节数
+ */
+static uint32_t tcp_tx_len(tcp_connect_t* connect) {
+    return ringbuf_len(&connect->tx_buf) + connect->tx_file_len;
+}
+
+/**
+ * @brief 取得发送队列offset处连续的一段数据，可能在tx_buf中，也可能在文件区域中
+ *        发送队列依次是tx_ext的ring_before字节tx_buf数据、tx_ext的文件数据、下一个文件区域的ring_before……，最后是剩余的tx_buf数据
+ *
+ * @param connect
+ * @param offset 相对unack_seq的偏移
+ * @param len 输入想要的长度，输出实际连续的长度
+ * @param from 输出数据所在的外部数据，在tx_buf中为NULL
+ * @return const uint8_t* 数据地址
+ */
+static const uint8_t* tcp_tx_span(tcp_connect_t* connect, uint32_t offset, uint32_t* len, const tcp_extent_t** from) {
+    uint32_t ring = 0; // 已经跳过的tx_buf数据量
+    *from = NULL;
+    for (tcp_extent_t* ext = connect->tx_ext; ext; ext = ext->next) {
+        if (offset < ext->ring_before) {
+            *len = min32(*len, ext->ring_before - offset);
+            return ringbuf_span(&connect->tx_buf, ring + offset, len);
+        }
+        offset -= ext->ring_before;
+        ring += ext->ring_before;
+        if (offset < ext->len) {
+            *len = min32(*len, ext->len - offset);
+            *from = ext;
+            return ext->data + offset;
+        }
+        offset -= ext->len;
+    }
+    return ringbuf_span(&connect->tx_buf, ring + offset, len);
+}
+
+/**
+ * @brief 用外部数据预先算好的分块校验和计算其中一段的部分校验和，
+ *        整块直接累加记录的值，只有两端不满一块的部分需要读数据
+ *
+ * @param ext
+ * @param src 这一段在ext中的地址
+ * @param len
+ * @return uint32_t 部分校验和，src按偶数位置计
+ */
+static uint32_t tcp_extent_sum(const tcp_extent_t* ext, const uint8_t* src, uint32_t len) {
+    uint32_t off = src - ext->sum_base;
+    uint32_t head = min32(len, (TCP_SUM_BLOCK - off % TCP_SUM_BLOCK) % TCP_SUM_BLOCK);
+    uint32_t sum = checksum_add(src, head, 0);
+    // 整块和剩下的尾部都从src后的第head个字节开始，head为奇数时高低位置互换
+    const uint32_t* block = ext->sums + (off + head) / TCP_SUM_BLOCK;
+    uint64_t acc = 0;
+    uint32_t i = head;
+    for (; len - i >= TCP_SUM_BLOCK; i += TCP_SUM_BLOCK)
+        acc += *block++;
+    while (acc >> 32)
+        acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    uint32_t rest = checksum_add(src + i, len - i, (uint32_t)acc);
+    if (head & 1)
+        rest = swap16((uint16_t)~checksum_fold(rest));
+    sum += rest;
+    sum += sum < rest; // 循环进位
+    return sum;
+}
+
+/**
+ * @brief 把发送队列offset处的len字节复制到dst，同时算出这段数据的部分校验和
+ *
+ * @param connect
+ * @param offset 相对unack_seq的偏移
+ * @param dst
+ * @param len
+ * @return uint32_t 部分校验和，dst按一个段负载的开头计
+ */
+static uint32_t tcp_tx_copy(tcp_connect_t* connect, uint32_t offset, uint8_t* dst, uint32_t len) {
+    uint32_t sum = 0;
+    for (uint32_t done = 0, n; done < len; done += n) {
+        n = len - done;
+        const tcp_extent_t* ext;
+        const uint8_t* src = tcp_tx_span(connect, offset + done, &n, &ext);
+        uint32_t part;
+        if (ext && ext->sums) { // 校验和已经算好，只需复制
+            memcpy(dst + done, src, n);
+            part = tcp_extent_sum(ext, src, n);
+        } else
+            part = checksum_copy(dst + done, src, n, 0);
+        if (done & 1) // 从奇数位置开始的一段，每个字节在16位字中的高低位置互换
+            part = swap16((uint16_t)~checksum_fold(part));
+        sum += part;
+        sum += sum < part; // 循环进位
+    }
+    return sum;
+}
+
+/**
+ * @brief 从发送队列头部去掉已被确认的数据，完全确认的文件区域解除映射
+ *
+ * @param connect
+ * @param len
+ */
+static void tcp_tx_discard(tcp_connect_t* connect, uint32_t len) {
+    while (len && connect->tx_ext) {
+        tcp_extent_t* ext = connect->tx_ext;
+        uint32_t n = min32(len, ext->ring_before);
+        ringbuf_discard(&connect->tx_buf, n);
+        ext->ring_before -= n;
+        len -= n;
+        n = min32(len, ext->len);
+        ext->data += n;
+        ext->len -= n;
+        connect->tx_file_len -= n;
+        len -= n;
+        if (ext->ring_before || ext->len)
+            break;
+        connect->tx_ext = ext->next;
+        if (connect->tx_ext == NULL)
+            connect->tx_ext_tail = NULL;
+        tcp_extent_free(ext);
+    }
+    ringbuf_discard(&connect->tx_buf, len);
+}
+
+/**
+ * @brief 释放TCP连接分配的缓存，把它从 connect_table 和所属端口的连接链表中摘下并释放
+ *
+ * @param connect
+ */
+static void tcp_connect_free(tcp_connect_t* connect) {
+    net_timer_cancel(&connect->rtx_timer);
+    net_timer_cancel(&connect->ack_timer);
+    net_timer_cancel(&connect->keepalive_timer);
+    net_timer_cancel(&connect->persist_timer);
+    if (connect->state != TCP_LISTEN) {
+        ringbuf_free(&connect->rx_buf);
+        ringbuf_free(&connect->tx_buf);
+    }
+    while (connect->tx_ext) {
+        tcp_extent_t* ext = connect->tx_ext;
+        connect->tx_ext = ext->next;
+        tcp_extent_free(ext);
+    }
+
+    tcp_connect_t** pp = &connect_table.buckets[connect->hash & connect_table.mask];
+    while (*pp != connect)
+        pp = &(*pp)->hash_next;
+    *pp = connect->hash_next;
+    connect_table.size--;
+
+    tcp_listener_t* listener = connect->listener;
+    if (listener) {
+        if (connect->port_prev)
+            connect->port_prev->port_next = connect->port_next;
+        else
+            listener->connects = connect->port_next;
+        if (connect->port_next)
+            connect->port_next->port_prev = connect->port_prev;
+        listener->connect_count--;
+        if (!connect->accepted) {
+            if (connect->accept_prev)
+                connect->accept_prev->accept_next = connect->accept_next;
+            else
+                listener->accept_head = connect->accept_next;
+            if (connect->accept_next)
+                connect->accept_next->accept_prev = connect->accept_prev;
+            else
+                listener->accept_tail = connect->accept_prev;
+            listener->accept_count--;
+        }
+    }
+    free(connect);
+}
+
+static uint16_t tcp_checksum(buf_t* buf, uint8_t* src_ip, uint8_t* dst_ip) {
+    uint16_t len = (uint16_t)buf->len;
+    tcp_peso_hdr_t* peso_hdr = (tcp_peso_hdr_t*)(buf->data - sizeof(tcp_peso_hdr_t));
+    tcp_peso_hdr_t pre; //暂存被覆盖的IP头
+    memcpy(&pre, peso_hdr, sizeof(tcp_peso_hdr_t));
+    memcpy(peso_hdr->src_ip, src_ip, NET_IP_LEN);
+    memcpy(peso_hdr->dst_ip, dst_ip, NET_IP_LEN);
+    peso_hdr->placeholder = 0;
+    peso_hdr->protocol = NET_PROTOCOL_TCP;
+    peso_hdr->total_len16 = swap16(len);
+    uint16_t checksum = checksum16((uint16_t*)peso_hdr, len + sizeof(tcp_peso_hdr_t));
+    memcpy(peso_hdr, &pre, sizeof(tcp_peso_hdr_t));
+    return checksum;
+}
+
+/**
+ * @brief 负载的部分校验和已知时计算TCP校验和，只读伪头部和TCP头部
+ *
+ * @param hdr TCP头部，校验和字段为0
+ * @param len TCP头部加负载的长度
+ * @param src_ip
+ * @param dst_ip
+ * @param payload_sum 负载的部分校验和
+ * @return uint16_t
+ */
+static uint16_t tcp_checksum_partial(tcp_hdr_t* hdr, size_t len, uint8_t* src_ip, uint8_t* dst_ip,
+    uint32_t payload_sum) {
+    tcp_peso_hdr_t peso_hdr;
+    memcpy(peso_hdr.src_ip, src_ip, NET_IP_LEN);
+    memcpy(peso_hdr.dst_ip, dst_ip, NET_IP_LEN);
+    peso_hdr.placeholder = 0;
+    peso_hdr.protocol = NET_PROTOCOL_TCP;
+    peso_hdr.total_len16 = swap16(len);
+    uint32_t sum = checksum_add(&peso_hdr, sizeof(peso_hdr), checksum_add(hdr, 4 * hdr->data_offset, 0));
+    sum += payload_sum;
+    sum += sum < payload_sum;
+    return checksum_fold(sum);
+}
+
+/**
+ * @brief 在 syn_table 中查找半连接
+ *
+ * @param key
+ * @return tcp_syn_entry_t* 找不到为NULL
+ */
+static tcp_syn_entry_t* tcp_syn_entry_lookup(const tcp_key_t* key) {
+    uint32_t hash = tcp_key_hash(key);
+    tcp_syn_entry_t* entry = syn_table.buckets[hash & (TCP_SYN_TABLE_SIZE - 1)];
+    while (entry && !(entry->hash == hash && !memcmp(&entry->key, key, sizeof(tcp_key_t))))
+        entry = entry->hash_next;
+    return entry;
+}
+
+/**
+ * @brief 从 syn_table 中删除并释放半连接
+ *
+ * @param entry
+ */
+static void tcp_syn_entry_free(tcp_syn_entry_t* entry) {
+    tcp_syn_entry_t** pp = &syn_table.buckets[entry->hash & (TCP_SYN_TABLE_SIZE - 1)];
+    while (*pp != entry)
+        pp = &(*pp)->hash_next;
+    *pp = entry->hash_next;
+
+    if (entry->age_prev)
+        entry->age_prev->age_next = entry->age_next;
+    else
+        syn_table.oldest = entry->age_next;
+    if (entry->age_next)
+        entry->age_next->age_prev = entry->age_prev;
+    else
+        syn_table.newest = entry->age_prev;
+
+    tcp_listener_t* listener = tcp_table[entry->key.dst_port];
+    if (listener)
+        listener->syn_count--;
+    free(entry);
+}
+
+/**
+ * @brief 清理过期的半连接，只需要从最老的开始检查
+ *
+ */
+static void tcp_syn_table_expire() {
+    time_t now = time(NULL);
+    while (syn_table.oldest && syn_table.oldest->created + TCP_SYN_TIMEOUT_SEC < now)
+        tcp_syn_entry_free(syn_table.oldest);
+}
+
+/**
+ * @brief 关闭 port 上的 TCP 连接
+ *        只需要遍历该端口自己的连接链表
+ *        供应用层使用
+ *
+ * @param port
+ */
+void tcp_close(uint16_t port) {
+    tcp_listener_t* listener = tcp_table[port];
+    if (listener == NULL)
+        return;
+    while (listener->connects)
+        tcp_connect_free(listener->connects);
+    tcp_syn_entry_t* entry = syn_table.oldest;
+    while (entry) {
+        tcp_syn_entry_t* next = entry->age_next;
+        if (entry->key.dst_port == port)
+            tcp_syn_entry_free(entry);
+        entry = next;
+    }
+    tcp_table[port] = NULL;
+    free(listener);
+}
+
+/**
+ * @brief 从 buf 中读取数据到 connect->rx_buf，放不下的部分不确认，等对端重传
+ *
+ * @param connect
+ * @param buf
+ * @return uint16_t 字节数
+ */
+static uint16_t tcp_read_from_buf(tcp_connect_t* connect, buf_t* buf) {
+    uint16_t size = ringbuf_write(&connect->rx_buf, buf->data, buf->len);
+    connect->ack += size;
+    return size;
+}
+
+/**
+ * @brief 本端通告的接收窗口，即rx_buf的剩余空间
+ *
+ * @param connect
+ * @return uint16_t
+ */
+static uint16_t tcp_rcv_window(tcp_connect_t* connect) {
+    return min32(ringbuf_space(&connect->rx_buf), UINT16_MAX);
+}
+
+/**
+ * @brief 下一次可以发送的长度：最多max字节，并且不超过对端窗口和拥塞窗口中尚未被在途数据占用的部分。
+ *
+ * @param connect
+ * @param max 上限，单个段为MSS，超级段为TCP_GSO_MAX_SIZE
+ * @return uint16_t 字节数
+ */
+static uint16_t tcp_send_size(tcp_connect_t* connect, uint16_t max) {
+    uint32_t sent = connect->next_seq - connect->unack_seq;
+    uint32_t win = min32(connect->remote_win, connect->cwnd);
+    uint32_t size = 0;
+    if (tcp_tx_len(connect) > sent && win > sent) {
+        size = min32(tcp_tx_len(connect) - sent, win - sent);
+        size = min32(size, max);
+    }
+    return size;
+}
+
+/**
+ * @brief 判断一个不满MSS的段是否应该等待：
+ *        NODELAY不等待；CORK一直等到tcp_connect_flush；NAGLE在有未确认的数据时等待。
+ *        被flush的数据和关闭时剩余的数据总是立即发出。
+ *
+ * @param connect
+ * @param size 段长度
+ * @return int 需要等待为1
+ */
+static int tcp_nagle_hold(tcp_connect_t* connect, uint16_t size) {
+    if (size >= connect->remote_mss || connect->state == TCP_FIN_WAIT_1 || connect->state == TCP_LAST_ACK ||
+        connect->state == TCP_CLOSING)
+        return 0;
+    if (connect->push && (int32_t)(connect->next_seq - connect->push_seq) < 0)
+        return 0;
+    switch (connect->policy) {
+    case TCP_SEND_NODELAY:
+        return 0;
+    case TCP_SEND_CORK:
+        return 1;
+    default:
+        return connect->next_seq != connect->unack_seq;
+    }
+}
+
+/**
+ * @brief 把发送队列offset处的size字节复制到buf里面，buf原来的内容会无效。
+ *        复制时按MSS分段算出每段负载的部分校验和，发送时不必再读一遍负载。
+ *
+ * @param connect
+ * @param buf
+ * @param offset 相对unack_seq的偏移
+ * @param size 字节数
+ */
+static void tcp_copy_to_buf(tcp_connect_t* connect, buf_t* buf, uint32_t offset, uint16_t size) {
+    uint16_t mss = connect->remote_mss;
+    uint16_t n = 0;
+    buf_init(buf, size);
+    for (uint32_t off = 0; off < size; off += mss, n++) {
+        uint32_t sum = tcp_tx_copy(connect, offset + off, buf->data + off, min32(mss, size - off));
+        if (n < BUF_MAX_SUMS)
+            buf->sums[n] = sum;
+    }
+    buf->sum_count = n <= BUF_MAX_SUMS ? n : 0;
+}
+
+/**
+ * @brief 把发送队列中下一段size字节的数据写入到buf里面供tcp_send使用，buf原来的内容会无效。
+ *
+ * @param connect
+ * @param buf
+ * @param size 由tcp_send_size得出的段长度
+ * @return uint16_t 字节数
+ */
+static uint16_t tcp_write_to_buf(tcp_connect_t* connect, buf_t* buf, uint16_t size) {
+    tcp_copy_to_buf(connect, buf, connect->next_seq - connect->unack_seq, size);
+    connect->next_seq += size;
+    return size;
+}
+
+/**
+ * @brief 解析TCP头部中的选项，目前只关心MSS和时间戳
+ *
+ * @param hdr
+ * @param opts 输出参数，没有出现的选项置0
+ */
+static void tcp_parse_options(tcp_hdr_t* hdr, tcp_options_t* opts) {
+    uint8_t* opt = (uint8_t*)(hdr + 1);
+    uint8_t* end = (uint8_t*)hdr + 4 * hdr->data_offset;
+    memset(opts, 0, sizeof(tcp_options_t));
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break;
+        if (opt[0] == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN)
+            opts->mss = (opt[2] << 8) | opt[3];
+        if (opt[0] == TCP_OPT_TS && opt[1] == TCP_OPT_TS_LEN) {
+            opts->ts = 1;
+            memcpy(&opts->tsval, opt + 2, 4);
+            memcpy(&opts->tsecr, opt + 6, 4);
+            opts->tsval = swap32(opts->tsval);
+            opts->tsecr = swap32(opts->tsecr);
+        }
+        opt += opt[1];
+    }
+}
+
+/**
+ * @brief 加上tcp头并发送，不依赖tcp_connect_t，握手和复位报文在还没有连接时也用它发送
+ *
+ * @param buf 负载
+ * @param ip 对端IP
+ * @param local_port
+ * @param remote_port
+ * @param seq
+ * @param ack
+ * @param flags
+ * @param window 通告的接收窗口
+ * @param opts 要携带的选项，mss非0时携带MSS选项，ts非0时携带时间戳选项，可以为NULL
+ */
+static void tcp_xmit(buf_t* buf, uint8_t* ip, uint16_t local_port, uint16_t remote_port,
+    uint32_t seq, uint32_t ack, tcp_flags_t flags, uint16_t window, const tcp_options_t* opts) {
+    display_flags(flags);
+    size_t mss_len = opts && opts->mss ? TCP_OPT_MSS_LEN : 0;
+    size_t opt_len = mss_len + (opts && opts->ts ? TCP_OPT_TS_SPACE : 0);
+    buf_add_header(buf, sizeof(tcp_hdr_t) + opt_len);
+    tcp_hdr_t* hdr = (tcp_hdr_t*)buf->data;
+    hdr->src_port16 = swap16(local_port);
+    hdr->dst_port16 = swap16(remote_port);
+    hdr->seq_number32 = swap32(seq);
+    hdr->ack_number32 = swap32(ack);
+    hdr->data_offset = (sizeof(tcp_hdr_t) + opt_len) / sizeof(uint32_t);
+    hdr->reserved = 0;
+    hdr->flags = flags;
+    hdr->window_size16 = swap16(window);
+    hdr->checksum16 = 0;
+    hdr->urgent_pointer16 = 0;
+    uint8_t* opt = (uint8_t*)(hdr + 1);
+    if (mss_len) {
+        opt[0] = TCP_OPT_MSS;
+        opt[1] = TCP_OPT_MSS_LEN;
+        opt[2] = opts->mss >> 8;
+        opt[3] = opts->mss & 0xFF;
+        opt += TCP_OPT_MSS_LEN;
+    }
+    if (opt_len > mss_len) {
+        uint32_t tsval = swap32(opts->tsval), tsecr = swap32(opts->tsecr);
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_NOP;
+        opt[2] = TCP_OPT_TS;
+        opt[3] = TCP_OPT_TS_LEN;
+        memcpy(opt + 4, &tsval, 4);
+        memcpy(opt + 8, &tsecr, 4);
+    }
+    if (!buf->gso_size) { // 超级段的校验和在切分时逐段计算
+        if (buf->sum_count == 1) // 负载的校验和在复制时已经算出，只需再加上伪头部和头部
+            hdr->checksum16 = tcp_checksum_partial(hdr, buf->len, net_if_ip, ip, buf->sums[0]);
+        else
+            hdr->checksum16 = tcp_checksum(buf, ip, net_if_ip);
+    }
+    ip_out(buf, ip, NET_PROTOCOL_TCP);
+}
+
+/**
+ * @brief 本端时间戳，毫秒时钟加上每个连接的随机偏移
+ *
+ * @param connect
+ * @return uint32_t
+ */
+static uint32_t tcp_ts_now(tcp_connect_t* connect) {
+    return (uint32_t)net_time_ms() + connect->ts_offset;
+}
+
+/**
+ * @brief 以指定的序号发送连接上的TCP包，重传时也用它
+ *        syn包会携带MSS选项，通告本端按MTU推出的MSS，并提议使用时间戳；协商了时间戳的连接每个包都带时间戳。
+ *        带ACK的包同时确认了之前延迟的数据，不需要再单独发ACK。
+ *
+ * @param buf
+ * @param connect
+ * @param seq
+ * @param flags
+ */
+static void tcp_send_seq(buf_t* buf, tcp_connect_t* connect, uint32_t seq, tcp_flags_t flags) {
+    tcp_options_t opts = { .mss = flags.syn ? TCP_MSS : 0 };
+    if (flags.syn || connect->ts_ok) {
+        opts.ts = 1;
+        opts.tsval = tcp_ts_now(connect);
+        opts.tsecr = connect->ts_recent;
+    }
+    tcp_xmit(buf, connect->ip, connect->local_port, connect->remote_port, seq,
+        connect->ack, flags, tcp_rcv_window(connect), &opts);
+    if (flags.ack) {
+        connect->last_ack_sent = connect->ack;
+        connect->ack_pending = 0;
+        net_timer_cancel(&connect->ack_timer);
+    }
+}
+
+/**
+ * @brief 发送TCP包, seq_number32 = connect->next_seq - buf->len
+ *        buf里的数据将作为负载，加上tcp头发送出去。如果flags包含syn或fin，seq会递增。
+ *
+ * @param buf
+ * @param connect
+ * @param flags
+ */
+static void tcp_send(buf_t* buf, tcp_connect_t* connect, tcp_flags_t flags) {
+    // printf("<< tcp send >> sz=%zu\n", buf->len);
+    tcp_send_seq(buf, connect, connect->next_seq - buf->len, flags);
+    if (flags.syn || flags.fin) {
+        connect->next_seq += 1;
+    }
+}
+
+/**
+ * @brief 延迟ACK定时器到期，发送一个单独的ACK
+ *
+ * @param arg 连接
+ */
+static void tcp_delack_timeout(void* arg) {
+    tcp_connect_t* connect = arg;
+    buf_init(&txbuf, 0);
+    tcp_send(&txbuf, connect, tcp_flags_ack);
+}
+
+/**
+ * @brief 安排确认收到的数据段(RFC 1122 4.2.3.2)
+ *        累计TCP_DELAYED_ACK_SEGS个段或者immediate时立即ACK，否则最多等待TCP_DELAYED_ACK_MS，
+ *        期间如果有数据发出，ACK会搭载在数据段上
+ *
+ * @param connect
+ * @param immediate
+ */
+static void tcp_ack_schedule(tcp_connect_t* connect, int immediate) {
+    if (immediate || connect->ack_pending >= TCP_DELAYED_ACK_SEGS) {
+        tcp_delack_timeout(connect);
+        return;
+    }
+    if (!net_timer_pending(&connect->ack_timer))
+        net_timer_set(&connect->ack_timer, TCP_DELAYED_ACK_MS, tcp_delack_timeout, connect);
+}
+
+static void tcp_rto_timeout(void* arg);
+static void tcp_persist_timeout(void* arg);
+
+/**
+ * @brief 把发送队列中窗口允许发送的数据发出，每段都不超过MSS，是一个独立的IP数据报，不会被IP分片。
+ *        连续多个满MSS的段合并成一个超级段，只经过一次tcp/ip/arp/ethernet的处理，由以太网层切分(GSO)。
+ *        不满MSS的段由tcp_nagle_hold按发送策略决定是否等待。
+ *        如果连接已经进入关闭流程且数据全部发出，再补发FIN。
+ *
+ * @param connect
+ * @return size_t 发出的数据字节数
+ */
+static size_t tcp_output(tcp_connect_t* connect) {
+    size_t total = 0;
+    uint16_t size;
+    uint16_t mss = connect->remote_mss;
+    int sent = 0;
+    while ((size = tcp_send_size(connect, max32(TCP_GSO_MAX_SIZE, mss))) > 0) {
+        if (size > mss)
+            size -= size % mss; // 超级段只装满MSS的段，剩下的尾巴下一轮再按发送策略判断
+        else if (tcp_nagle_hold(connect, size))
+            break;
+        tcp_write_to_buf(connect, &txbuf, size);
+        txbuf.gso_size = size > mss ? mss : 0;
+        tcp_send(&txbuf, connect, tcp_flags_ack);
+        if (!connect->rtt_timing) {
+            connect->rtt_timing = 1;
+            connect->rtt_seq = connect->next_seq;
+            connect->rtt_start = net_time_ms();
+        }
+        total += size;
+        sent = 1;
+    }
+    if (connect->push && (int32_t)(connect->next_seq - connect->push_seq) >= 0)
+        connect->push = 0;
+    if ((connect->state == TCP_FIN_WAIT_1 || connect->state == TCP_LAST_ACK || connect->state == TCP_CLOSING) &&
+        !connect->fin_sent &&
+        connect->next_seq - connect->unack_seq == tcp_tx_len(connect)) {
+        buf_init(&txbuf, 0);
+        tcp_send(&txbuf, connect, tcp_flags_ack_fin);
+        connect->fin_sent = 1;
+        sent = 1;
+    }
+    if (sent && !net_timer_pending(&connect->rtx_timer))
+        net_timer_set(&connect->rtx_timer, connect->rto, tcp_rto_timeout, connect);
+    // 对端窗口为0时没有在途数据，重传定时器不会启动，窗口更新丢失后连接会一直停住，由坚持定时器探测窗口
+    if (connect->remote_win == 0 && connect->next_seq == connect->unack_seq && tcp_tx_len(connect) > 0) {
+        if (!net_timer_pending(&connect->persist_timer))
+            net_timer_set(&connect->persist_timer, min32(connect->rto << connect->persist_backoff, TCP_MAX_RTO_MS),
+                tcp_persist_timeout, connect);
+    } else if (net_timer_pending(&connect->persist_timer)) {
+        net_timer_cancel(&connect->persist_timer);
+        connect->persist_backoff = 0;
+    }
+    return total;
+}
+
+/**
+ * @brief 以state回调连接的handler，回调期间写入的数据由调用者在回调返回后用tcp_output统一发送
+ *
+ * @param connect
+ * @param state
+ */
+static void tcp_notify(tcp_connect_t* connect, connect_state_t state) {
+    if (connect->handler == NULL)
+        return;
+    tcp_connect_t* prev = tcp_notifying;
+    tcp_notifying = connect;
+    connect->handler(connect, state);
+    tcp_notifying = prev;
+}
+
+/**
+ * @brief 连接进入ESTABLISHED时初始化拥塞控制和重传状态
+ *
+ * @param connect
+ */
+static void tcp_cc_init(tcp_connect_t* connect) {
+    connect->cwnd = min32(TCP_INIT_CWND_SEGS * connect->remote_mss, max32(2 * connect->remote_mss, 14600));
+    connect->ssthresh = UINT32_MAX;
+    connect->rto = TCP_INITIAL_RTO_MS;
+    connect->retries = 0;
+}
+
+/**
+ * @brief 用一个往返时间样本更新srtt、rttvar和rto(RFC 6298)
+ *
+ * @param connect
+ * @param rtt 毫秒
+ */
+static void tcp_rtt_sample(tcp_connect_t* connect, uint32_t rtt) {
+    if (rtt > TCP_MAX_RTO_MS)
+        return; // 时间戳回显异常
+    if (connect->srtt == 0 && connect->rttvar == 0) {
+        connect->srtt = rtt;
+        connect->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = connect->srtt > rtt ? connect->srtt - rtt : rtt - connect->srtt;
+        connect->rttvar = (3 * connect->rttvar + delta) / 4;
+        connect->srtt = (7 * connect->srtt + rtt) / 8;
+    }
+    connect->rto = connect->srtt + max32(NET_TIMER_TICK_MS, 4 * connect->rttvar);
+    connect->rto = min32(max32(connect->rto, TCP_MIN_RTO_MS), TCP_MAX_RTO_MS);
+}
+
+/**
+ * @brief 重传发送队列中第一个未确认的段，如果这个段之后就是已发出的FIN，一起重传
+ *
+ * @param connect
+ */
+static void tcp_retransmit(tcp_connect_t* connect) {
+    uint32_t flight = connect->next_seq - connect->unack_seq;
+    uint32_t data = min32(flight, tcp_tx_len(connect));
+    uint16_t size = min32(data, connect->remote_mss);
+    tcp_flags_t flags = tcp_flags_ack;
+    if (connect->fin_sent && size + 1 == flight)
+        flags.fin = 1;
+    tcp_copy_to_buf(connect, &txbuf, 0, size);
+    tcp_send_seq(&txbuf, connect, connect->unack_seq, flags);
+    connect->rtt_timing = 0; // Karn算法，重传过的段不计时
+    tcp_stats.retransmitted_segs++;
+    net_timer_set(&connect->rtx_timer, connect->rto, tcp_rto_timeout, connect);
+}
+
+/**
+ * @brief 重传定时器到期：超时时间加倍，拥塞窗口降为一个MSS，重传第一个未确认的段；
+ *        之后的部分确认按NewReno逐段重传。连续超时次数用完则以TCP_CONN_CLOSED通知应用层并释放连接
+ *
+ * @param arg 连接
+ */
+static void tcp_rto_timeout(void* arg) {
+    tcp_connect_t* connect = arg;
+    uint32_t flight = connect->next_seq - connect->unack_seq;
+    if (flight == 0)
+        return;
+    if (connect->retries >= TCP_RETRIES) {
+        tcp_notify(connect, TCP_CONN_CLOSED);
+        tcp_connect_free(connect);
+        return;
+    }
+    tcp_stats.rto_timeouts++;
+    connect->retries++;
+    connect->rto = min32(connect->rto * 2, TCP_MAX_RTO_MS);
+    if (!connect->in_recovery)
+        connect->ssthresh = max32(flight / 2, 2 * connect->remote_mss);
+    connect->cwnd = connect->remote_mss;
+    connect->in_recovery = 1;
+    connect->recover = connect->next_seq;
+    connect->dupacks = 0;
+    tcp_retransmit(connect);
+}
+
+/**
+ * @brief 根据握手最后收到的报文决定是否使用时间戳：对端在这个报文中带了时间戳说明双方都同意使用。
+ *        时间戳占用每个段12字节，发送方向的MSS相应减小；报文回显的时间戳给出第一个往返时间样本
+ *
+ * @param connect 已经调用过tcp_cc_init
+ * @param opts 握手报文的选项
+ */
+static void tcp_ts_init(tcp_connect_t* connect, const tcp_options_t* opts) {
+    connect->ts_ok = opts->ts;
+    if (!connect->ts_ok)
+        return;
+    connect->ts_recent = opts->tsval;
+    connect->last_ack_sent = connect->ack;
+    connect->remote_mss -= TCP_OPT_TS_SPACE;
+    if (opts->tsecr)
+        tcp_rtt_sample(connect, tcp_ts_now(connect) - opts->tsecr);
+}
+
+/**
+ * @brief 回收一个对端已经消失的连接：向对端发送RST，以TCP_CONN_CLOSED通知应用层并释放连接
+ *
+ * @param connect
+ */
+static void tcp_connect_reap(tcp_connect_t* connect) {
+    tcp_stats.reaped_connections++;
+    buf_init(&txbuf, 0);
+    tcp_xmit(&txbuf, connect->ip, connect->local_port, connect->remote_port, connect->next_seq, 0,
+        (tcp_flags_t){ .rst = 1 }, 0, NULL);
+    tcp_notify(connect, TCP_CONN_CLOSED);
+    tcp_connect_free(connect);
+}
+
+static void tcp_keepalive_timeout(void* arg);
+
+/**
+ * @brief 坚持定时器到期：发送序号为unack_seq-1的窗口探测，对端会回复带有当前窗口的ACK，
+ *        窗口打开后tcp_output照常发送。间隔按RTO指数退避，最长TCP_MAX_RTO_MS；
+ *        连续TCP_RETRIES次探测都没有收到任何报文则回收连接，对端一直回复0窗口则一直探测
+ *
+ * @param arg 连接
+ */
+static void tcp_persist_timeout(void* arg) {
+    tcp_connect_t* connect = arg;
+    if (connect->remote_win != 0 || connect->next_seq != connect->unack_seq || tcp_tx_len(connect) == 0) {
+        connect->persist_backoff = 0;
+        return;
+    }
+    if (connect->persist_probes >= TCP_RETRIES) {
+        tcp_connect_reap(connect);
+        return;
+    }
+    connect->persist_probes++;
+    if ((connect->rto << connect->persist_backoff) < TCP_MAX_RTO_MS)
+        connect->persist_backoff++;
+    buf_init(&txbuf, 0);
+    tcp_send_seq(&txbuf, connect, connect->unack_seq - 1, tcp_flags_ack);
+    net_timer_set(&connect->persist_timer, min32(connect->rto << connect->persist_backoff, TCP_MAX_RTO_MS),
+        tcp_persist_timeout, connect);
+}
+
+/**
+ * @brief 按连接当前的状态启动保活定时器，到期时间从最后一次收到报文算起
+ *        FIN_WAIT_2等待对端FIN，其他状态按保活和空闲超时设置，都没有设置时不启动
+ *
+ * @param connect
+ */
+static void tcp_keepalive_arm(tcp_connect_t* connect) {
+    uint64_t now = net_time_ms();
+    uint64_t deadline = UINT64_MAX;
+    if (connect->state == TCP_FIN_WAIT_2)
+        deadline = connect->last_recv + TCP_FIN_WAIT2_TIMEOUT_SEC * 1000ULL;
+    if (connect->idle_timeout)
+        deadline = min64(deadline, connect->last_recv + connect->idle_timeout * 1000ULL);
+    if (connect->keepalive_idle) {
+        if (connect->probes_sent)
+            deadline = min64(deadline, now + connect->keepalive_intvl * 1000ULL);
+        else
+            deadline = min64(deadline, connect->last_recv + connect->keepalive_idle * 1000ULL);
+    }
+    if (deadline == UINT64_MAX)
+        net_timer_cancel(&connect->keepalive_timer);
+    else
+        net_timer_set(&connect->keepalive_timer, deadline > now ? deadline - now : 0, tcp_keepalive_timeout, connect);
+}
+
+/**
+ * @brief 保活定时器到期：对端空闲超时或FIN_WAIT_2超时的连接被回收；
+ *        空闲超过keepalive_idle且没有在途数据时发送序号为unack_seq-1的探测，对端会回复ACK，
+ *        连续keepalive_probes次没有回应则回收。收到报文只更新last_recv，不需要重新启动定时器
+ *
+ * @param arg 连接
+ */
+static void tcp_keepalive_timeout(void* arg) {
+    tcp_connect_t* connect = arg;
+    uint64_t idle = net_time_ms() - connect->last_recv;
+    if ((connect->state == TCP_FIN_WAIT_2 && idle >= TCP_FIN_WAIT2_TIMEOUT_SEC * 1000ULL) ||
+        (connect->idle_timeout && idle >= connect->idle_timeout * 1000ULL)) {
+        tcp_connect_reap(connect);
+        return;
+    }
+    if (connect->keepalive_idle && idle >= connect->keepalive_idle * 1000ULL &&
+        connect->state == TCP_ESTABLISHED && connect->next_seq == connect->unack_seq) {
+        if (connect->probes_sent >= connect->keepalive_probes) {
+            tcp_connect_reap(connect);
+            return;
+        }
+        connect->probes_sent++;
+        buf_init(&txbuf, 0);
+        tcp_send_seq(&txbuf, connect, connect->unack_seq - 1, tcp_flags_ack);
+    }
+    tcp_keepalive_arm(connect);
+}
+
+/**
+ * @brief 处理对端的ACK：从发送队列中去掉已被确认的数据，更新对端窗口、往返时间和拥塞窗口
+ *        连续TCP_DUPACK_THRESHOLD个重复ACK触发快速重传并进入快速恢复，
+ *        恢复期间的部分确认立即重传下一个未确认的段，完全确认后退出恢复(RFC 5681, RFC 6582)
+ *
+ * @param connect
+ * @param ack_number
+ * @param window_size
+ * @param seg_len 报文占用的序号数，非0的报文不算重复ACK
+ * @param tsecr 报文回显的时间戳，协商了时间戳时每个确认新数据的ACK都给出一个往返时间样本，重传的段也可以，0表示没有
+ */
+static void tcp_ack_process(tcp_connect_t* connect, uint32_t ack_number, uint16_t window_size, size_t seg_len,
+    uint32_t tsecr) {
+    uint32_t acked = ack_number - connect->unack_seq;
+    uint32_t flight = connect->next_seq - connect->unack_seq;
+    uint32_t mss = connect->remote_mss;
+    if (acked > flight)
+        return;
+
+    if (acked == 0) {
+        if (seg_len == 0 && flight > 0 && window_size == connect->remote_win) {
+            connect->dupacks++;
+            if (connect->in_recovery && connect->dupacks > TCP_DUPACK_THRESHOLD) {
+                connect->cwnd += mss; // 每个重复ACK说明有一个段离开了网络
+            } else if (!connect->in_recovery && connect->dupacks == TCP_DUPACK_THRESHOLD) {
+                tcp_stats.fast_retransmits++;
+                connect->ssthresh = max32(flight / 2, 2 * mss);
+                connect->in_recovery = 1;
+                connect->recover = connect->next_seq;
+                tcp_retransmit(connect);
+                connect->cwnd = connect->ssthresh + TCP_DUPACK_THRESHOLD * mss;
+            }
+        }
+        connect->remote_win = window_size;
+        return;
+    }
+
+    // FIN占用一个序号，但不在发送队列中
+    tcp_tx_discard(connect, acked);
+    connect->unack_seq = ack_number;
+    connect->remote_win = window_size;
+    connect->dupacks = 0;
+    connect->retries = 0;
+    flight -= acked;
+    if (connect->ts_ok && tsecr) {
+        tcp_rtt_sample(connect, tcp_ts_now(connect) - tsecr);
+    } else if (connect->rtt_timing && (int32_t)(ack_number - connect->rtt_seq) >= 0) {
+        connect->rtt_timing = 0;
+        tcp_rtt_sample(connect, net_time_ms() - connect->rtt_start);
+    }
+
+    if (connect->in_recovery) {
+        if ((int32_t)(ack_number - connect->recover) >= 0) {
+            tcp_stats.recoveries++;
+            connect->in_recovery = 0;
+            connect->cwnd = min32(connect->ssthresh, max32(flight, mss) + mss);
+        } else {
+            tcp_stats.partial_ack_retransmits++;
+            connect->cwnd = (connect->cwnd > acked ? connect->cwnd - acked : 0) + (acked >= mss ? mss : 0);
+            connect->cwnd = max32(connect->cwnd, mss);
+            tcp_retransmit(connect);
+            return;
+        }
+    } else if (connect->cwnd < connect->ssthresh) {
+        connect->cwnd += min32(acked, mss);
+    } else {
+        connect->cwnd += max32(1, mss * mss / connect->cwnd);
+    }
+
+    if (flight > 0)
+        net_timer_set(&connect->rtx_timer, connect->rto, tcp_rto_timeout, connect);
+    else
+        net_timer_cancel(&connect->rtx_timer);
+}
+
+/**
+ * @brief 从外部关闭一个TCP连接, 会发送剩余数据，数据发完后发出FIN。
+ *        对端已经关闭或者已经在关闭流程中的连接不立即释放，等发送队列中的数据和FIN都被确认、
+ *        或者重传超时放弃后再释放，发送队列中的响应不会丢失。
+ *        供应用层使用
+ *
+ * @param connect
+ */
+void tcp_connect_close(tcp_connect_t* connect) {
+    switch (connect->state) {
+    case TCP_ESTABLISHED:
+        connect->state = TCP_FIN_WAIT_1;
+        connect->fin_queued = 1;
+        break;
+    case TCP_CLOSE_WAIT:
+        connect->state = TCP_LAST_ACK;
+        connect->fin_queued = 1;
+        break;
+    case TCP_LAST_ACK:
+    case TCP_FIN_WAIT_1:
+    case TCP_FIN_WAIT_2:
+    case TCP_CLOSING:
+        break;
+    default:
+        tcp_connect_free(connect);
+        return;
+    }
+    tcp_output(connect);
+}
+
+/**
+ * @brief 对没有对应连接的报文回复RST，RST本身不回复
+ *
+ * @param key
+ * @param hdr
+ * @param seg_len 报文的数据长度
+ */
+static void tcp_send_reset(tcp_key_t* key, tcp_hdr_t* hdr, size_t seg_len) {
+    if (hdr->flags.rst)
+        return;
+    buf_init(&txbuf, 0);
+    if (hdr->flags.ack) {
+        tcp_xmit(&txbuf, key->ip, key->dst_port, key->src_port, swap32(hdr->ack_number32), 0,
+            (tcp_flags_t){ .rst = 1 }, 0, NULL);
+    } else {
+        uint32_t ack = swap32(hdr->seq_number32) + seg_len + hdr->flags.syn + hdr->flags.fin;
+        tcp_xmit(&txbuf, key->ip, key->dst_port, key->src_port, 0, ack, tcp_flags_ack_rst, 0, NULL);
+    }
+}
+
+/**
+ * @brief 在 tw_table 中查找TIME_WAIT条目
+ *
+ * @param key
+ * @return uint32_t 条目下标，找不到为TCP_TW_NIL
+ */
+static uint32_t tcp_tw_lookup(const tcp_key_t* key) {
+    uint32_t i = tw_table.buckets[tcp_key_hash(key) & tw_table.mask];
+    while (i != TCP_TW_NIL && memcmp(&tw_table.pool[i].key, key, sizeof(tcp_key_t)))
+        i = tw_table.pool[i].hash_next;
+    return i;
+}
+
+/**
+ * @brief 把条目挂到时间轮的当前格，TCP_TW_SLOTS秒后被释放
+ *
+ * @param i
+ */
+static void tcp_tw_wheel_add(uint32_t i) {
+    tcp_timewait_t* slot = &tw_table.pool[tw_table.tick];
+    tw_table.pool[i].prev = slot->prev;
+    tw_table.pool[i].next = tw_table.tick;
+    tw_table.pool[slot->prev].next = i;
+    slot->prev = i;
+}
+
+static void tcp_tw_wheel_del(uint32_t i) {
+    tcp_timewait_t* tw = &tw_table.pool[i];
+    tw_table.pool[tw->prev].next = tw->next;
+    tw_table.pool[tw->next].prev = tw->prev;
+}
+
+/**
+ * @brief 把 tw_table 的桶数翻倍，所有条目都在时间轮上，按时间轮遍历重新挂链
+ *
+ */
+static void tcp_tw_table_grow() {
+    uint32_t size = (tw_table.mask + 1) * 2;
+    uint32_t* buckets = malloc(size * sizeof(uint32_t));
+    if (buckets == NULL)
+        return;
+    memset(buckets, 0xFF, size * sizeof(uint32_t));
+    for (uint32_t slot = 0; slot < TCP_TW_SLOTS; slot++) {
+        for (uint32_t i = tw_table.pool[slot].next; i != slot; i = tw_table.pool[i].next) {
+            uint32_t* bucket = &buckets[tcp_key_hash(&tw_table.pool[i].key) & (size - 1)];
+            tw_table.pool[i].hash_next = *bucket;
+            *bucket = i;
+        }
+    }
+    free(tw_table.buckets);
+    tw_table.buckets = buckets;
+    tw_table.mask = size - 1;
+}
+
+/**
+ * @brief 从 tw_table 中删除条目，放回空闲链表
+ *
+ * @param i
+ */
+static void tcp_tw_free(uint32_t i) {
+    uint32_t* pp = &tw_table.buckets[tcp_key_hash(&tw_table.pool[i].key) & tw_table.mask];
+    while (*pp != i)
+        pp = &tw_table.pool[*pp].hash_next;
+    *pp = tw_table.pool[i].hash_next;
+    tcp_tw_wheel_del(i);
+    tw_table.pool[i].next = tw_table.free;
+    tw_table.free = i;
+    tw_table.count--;
+}
+
+/**
+ * @brief 时间轮转动一格，释放这一格中已经满2MSL的条目
+ *
+ * @param arg 未使用
+ */
+static void tcp_tw_tick(void* arg) {
+    tw_table.tick = (tw_table.tick + 1) % TCP_TW_SLOTS;
+    while (tw_table.pool[tw_table.tick].next != tw_table.tick)
+        tcp_tw_free(tw_table.pool[tw_table.tick].next);
+    if (tw_table.count)
+        net_timer_set(&tw_table.timer, 1000, tcp_tw_tick, NULL);
+}
+
+/**
+ * @brief 主动关闭的连接收到对端的FIN后进入TIME_WAIT：记下序号放入 tw_table，释放连接和缓存
+ *        条目数达到上限或分配失败时直接释放
+ *
+ * @param connect
+ */
+static void tcp_connect_timewait(tcp_connect_t* connect) {
+    uint32_t i = tw_table.free;
+    if (i == TCP_TW_NIL && tw_table.count < TCP_MAX_TIMEWAIT) {
+        uint32_t capacity = tw_table.capacity * 2;
+        tcp_timewait_t* pool = realloc(tw_table.pool, capacity * sizeof(tcp_timewait_t));
+        if (pool) {
+            for (uint32_t j = capacity; j-- > tw_table.capacity;) {
+                pool[j].next = tw_table.free;
+                tw_table.free = j;
+            }
+            tw_table.pool = pool;
+            tw_table.capacity = capacity;
+            i = tw_table.free;
+        }
+    }
+    if (i == TCP_TW_NIL || tw_table.count >= TCP_MAX_TIMEWAIT) {
+        tcp_stats.timewait_overflows++;
+        tcp_connect_free(connect);
+        return;
+    }
+    tw_table.free = tw_table.pool[i].next;
+
+    if (tw_table.count > tw_table.mask)
+        tcp_tw_table_grow();
+    tcp_timewait_t* tw = &tw_table.pool[i];
+    tw->key = new_tcp_key(connect->ip, connect->local_ip, connect->remote_port, connect->local_port);
+    tw->snd_nxt = connect->next_seq;
+    tw->rcv_nxt = connect->ack;
+    uint32_t* bucket = &tw_table.buckets[tcp_key_hash(&tw->key) & tw_table.mask];
+    tw->hash_next = *bucket;
+    *bucket = i;
+    tcp_tw_wheel_add(i);
+    tw_table.count++;
+    if (!net_timer_pending(&tw_table.timer))
+        net_timer_set(&tw_table.timer, 1000, tcp_tw_tick, NULL);
+    tcp_connect_free(connect);
+}
 
-/* Connect_table放置了一堆TCP连接，
-    KEY为[IP，src port，dst port], 即tcp_key_t，VALUE为tcp_connect_t。
-*/
-static map_t connect_table; 
+/**
+ * @brief 处理落在TIME_WAIT上的报文
+ *        RST被忽略，防止TIME_WAIT被提前结束(RFC 1337)；
+ *        序号大于原连接的SYN可以提前结束TIME_WAIT，开始新的连接(RFC 1122 4.2.2.13)；
+ *        重传的FIN回复ACK并重新计时2MSL，其他带数据或序号不对的报文回复ACK。
+ *
+ * @param i 条目下标
+ * @param hdr
+ * @param seg_len 报文的数据长度
+ * @param tw_isn 输出参数，复用时新连接应使用的初始序号，保证比原连接的序号大一个窗口以上
+ * @return int 条目已被新SYN复用，报文应当按没有连接处理时为1
+ */
+static int tcp_timewait_in(uint32_t i, tcp_hdr_t* hdr, size_t seg_len, uint32_t* tw_isn) {
+    tcp_timewait_t* tw = &tw_table.pool[i];
+    tcp_flags_t flags = hdr->flags;
+    uint32_t seq = swap32(hdr->seq_number32);
+    if (flags.rst)
+        return 0;
+    if (flags.syn && !flags.ack && (int32_t)(seq - tw->rcv_nxt) > 0) {
+        *tw_isn = tw->snd_nxt + UINT16_MAX + 2;
+        tcp_tw_free(i);
+        tcp_stats.timewait_recycled++;
+        return 1;
+    }
+    if (flags.fin) {
+        tcp_tw_wheel_del(i);
+        tcp_tw_wheel_add(i);
+    }
+    if (flags.fin || flags.syn || seg_len > 0 || seq != tw->rcv_nxt) {
+        buf_init(&txbuf, 0);
+        tcp_xmit(&txbuf, tw->key.ip, tw->key.dst_port, tw->key.src_port, tw->snd_nxt, tw->rcv_nxt,
+            tcp_flags_ack, 0, NULL);
+    }
+    return 0;
+}
 
 /**
- * @brief 生成一个用于 connect_table 的 key
+ * @brief 生成初始序号，同一四元组的序号随时间增长，不同四元组之间不可预测(RFC 6528)
  *
- * @param ip
- * @param src_port
- * @param dst_port
- * @return tcp_key_t
+ * @param key
+ * @return uint32_t
  */
-static tcp_key_t new_tcp_key(uint8_t ip[NET_IP_LEN], uint16_t src_port, uint16_t dst_port) {
-    tcp_key_t key;
-    memcpy(key.ip, ip, NET_IP_LEN);
-    key.src_port = src_port;
-    key.dst_port = dst_port;
-    return key;
+static uint32_t tcp_new_iss(const tcp_key_t* key) {
+    return tcp_hash(key, tcp_secret[2]) + (uint32_t)(net_time_ms() * 250);
 }
 
 /**
- * @brief 初始化tcp在静态区的map
- *        供应用层使用
+ * @brief SYN cookie的计数器，每64秒加一
  *
+ * @return uint32_t
  */
-void tcp_init() {
-    map_init(&tcp_table, sizeof(uint16_t), sizeof(tcp_handler_t), 0, 0, NULL);
-    map_init(&connect_table, sizeof(tcp_key_t), sizeof(tcp_connect_t), 0, 0, NULL);
-    net_add_protocol(NET_PROTOCOL_TCP, tcp_in);
+static uint32_t tcp_cookie_counter() {
+    return (uint32_t)(time(NULL) >> 6);
 }
 
 /**
- * @brief 向 port 注册一个 TCP 连接以及关联的回调函数
- *        供应用层使用
+ * @brief 生成SYN cookie作为本端初始序号，MSS编码在cookie中，服务器不需要保存任何状态
  *
- * @param port
- * @param handler
- * @return int
+ * @param key
+ * @param irs 对端初始序号
+ * @param mss 发送方向的有效MSS
+ * @return uint32_t
  */
-int tcp_open(uint16_t port, tcp_handler_t handler) {
-    printf("tcp open\n");
-    return map_set(&tcp_table, &port, &handler);
+static uint32_t tcp_cookie_make(const tcp_key_t* key, uint32_t irs, uint16_t mss) {
+    uint32_t count = tcp_cookie_counter();
+    uint32_t index = sizeof(tcp_cookie_mss) / sizeof(tcp_cookie_mss[0]) - 1;
+    while (index > 0 && tcp_cookie_mss[index] > mss)
+        index--;
+    return tcp_hash(key, tcp_secret[0]) + irs + (count << 24) +
+        ((tcp_hash(key, tcp_secret[1] ^ count) + index) & TCP_COOKIE_MASK);
 }
 
 /**
- * @brief 完成了缓存分配工作，状态也会切换为TCP_SYN_RCVD
- *        rx_buf和tx_buf在触及边界时会把数据重新移动到头部，防止溢出。
+ * @brief 校验握手最后一个ACK中的SYN cookie
  *
- * @param connect
+ * @param key
+ * @param irs 对端初始序号
+ * @param cookie 本端初始序号，即ACK号-1
+ * @return uint16_t 编码在cookie中的MSS，校验失败为0
  */
-static void init_tcp_connect_rcvd(tcp_connect_t* connect) {
-    if (connect->state == TCP_LISTEN) {
-        connect->rx_buf = malloc(sizeof(buf_t));
-        connect->tx_buf = malloc(sizeof(buf_t));
-    }
-    buf_init(connect->rx_buf, 0);
-    buf_init(connect->tx_buf, 0);
-    connect->state = TCP_SYN_RCVD;
+static uint16_t tcp_cookie_check(const tcp_key_t* key, uint32_t irs, uint32_t cookie) {
+    uint32_t count = tcp_cookie_counter();
+    cookie -= tcp_hash(key, tcp_secret[0]) + irs;
+    uint32_t diff = (count - (cookie >> 24)) & 0xFF;
+    if (diff >= TCP_COOKIE_MAX_AGE)
+        return 0;
+    uint32_t index = (cookie - tcp_hash(key, tcp_secret[1] ^ (count - diff))) & TCP_COOKIE_MASK;
+    if (index >= sizeof(tcp_cookie_mss) / sizeof(tcp_cookie_mss[0]))
+        return 0;
+    return tcp_cookie_mss[index];
 }
 
 /**
- * @brief 释放TCP连接，这会释放分配的空间，并把状态变回LISTEN。
- *        一般这个后边都会跟个map_delete(&connect_table, &key)把状态变回CLOSED
+ * @brief 监听端口收到SYN：记入半连接队列并回复SYN+ACK，队列满时改用SYN cookie，都不分配连接
  *
- * @param connect
+ * @param listener
+ * @param key
+ * @param hdr
+ * @param tw_isn 复用TIME_WAIT时指定的初始序号，0表示没有
  */
-static void release_tcp_connect(tcp_connect_t* connect) {
-    if (connect->state == TCP_LISTEN)
+static void tcp_syn_recv(tcp_listener_t* listener, tcp_key_t* key, tcp_hdr_t* hdr, uint32_t tw_isn) {
+    uint32_t irs = swap32(hdr->seq_number32);
+    tcp_options_t opts;
+    tcp_parse_options(hdr, &opts);
+    uint16_t mss = min32(opts.mss ? opts.mss : TCP_DEFAULT_MSS, TCP_MSS);
+    uint32_t iss;
+
+    if (listener->handler == NULL && listener->accept_count >= listener->backlog) {
+        tcp_stats.listen_overflows++;
         return;
-    free(connect->rx_buf);
-    free(connect->tx_buf);
-    connect->state = TCP_LISTEN;
-}
+    }
 
-static uint16_t tcp_checksum(buf_t* buf, uint8_t* src_ip, uint8_t* dst_ip) {
-    uint16_t len = (uint16_t)buf->len;
-    tcp_peso_hdr_t* peso_hdr = (tcp_peso_hdr_t*)(buf->data - sizeof(tcp_peso_hdr_t));
-    tcp_peso_hdr_t pre; //暂存被覆盖的IP头
-    memcpy(&pre, peso_hdr, sizeof(tcp_peso_hdr_t));
-    memcpy(peso_hdr->src_ip, src_ip, NET_IP_LEN);
-    memcpy(peso_hdr->dst_ip, dst_ip, NET_IP_LEN);
-    peso_hdr->placeholder = 0;
-    peso_hdr->protocol = NET_PROTOCOL_TCP;
-    peso_hdr->total_len16 = swap16(len);
-    uint16_t checksum = checksum16((uint16_t*)peso_hdr, len + sizeof(tcp_peso_hdr_t));
-    memcpy(peso_hdr, &pre, sizeof(tcp_peso_hdr_t));
-    return checksum;
-}
+    tcp_syn_table_expire();
+    tcp_syn_entry_t* entry = tcp_syn_entry_lookup(key);
+    if (entry != NULL && entry->irs == irs) {
+        iss = entry->iss; // SYN重传，按原来的序号再回复一次
+    } else if (entry == NULL && listener->syn_count < listener->syn_queue_len &&
+        (entry = malloc(sizeof(tcp_syn_entry_t))) != NULL) {
+        entry->key = *key;
+        entry->hash = tcp_key_hash(key);
+        entry->iss = tw_isn ? tw_isn : tcp_new_iss(key);
+        entry->irs = irs;
+        entry->mss = mss;
+        entry->created = time(NULL);
+        entry->hash_next = syn_table.buckets[entry->hash & (TCP_SYN_TABLE_SIZE - 1)];
+        syn_table.buckets[entry->hash & (TCP_SYN_TABLE_SIZE - 1)] = entry;
+        entry->age_next = NULL;
+        entry->age_prev = syn_table.newest;
+        if (syn_table.newest)
+            syn_table.newest->age_next = entry;
+        else
+            syn_table.oldest = entry;
+        syn_table.newest = entry;
+        listener->syn_count++;
+        iss = entry->iss;
+    } else {
+        tcp_stats.syn_queue_overflows++;
+        iss = tcp_cookie_make(key, irs, mss);
+    }
 
-static _Thread_local uint16_t delete_port;
+    tcp_options_t syn_opts = { .mss = TCP_MSS };
+    if (opts.ts) {
+        syn_opts.ts = 1;
+        syn_opts.tsval = (uint32_t)net_time_ms() + tcp_hash(key, tcp_secret[3]);
+        syn_opts.tsecr = opts.tsval;
+    }
+    buf_init(&txbuf, 0);
+    tcp_xmit(&txbuf, key->ip, key->dst_port, key->src_port, iss, irs + 1, tcp_flags_ack_syn,
+        min32(listener->rx_buf_size, UINT16_MAX), &syn_opts);
+}
 
 /**
- * @brief tcp_close使用这个函数来查找可以关闭的连接，使用thread-local变量delete_port传递端口号。
+ * @brief 处理没有对应连接的报文
+ *        SYN交给tcp_syn_recv；握手的最后一个ACK从半连接队列或SYN cookie中恢复参数，这时才分配连接，
+ *        连接交给端口的回调函数或放入全连接队列，全连接队列满时丢弃这个ACK，等对端重传；
+ *        RST清除对应的半连接；其余报文以及没有监听的端口回复RST。
  *
- * @param key,value,timestamp
+ * @param listener 目标端口的监听，可以为NULL
+ * @param key
+ * @param hdr
+ * @param seg_len 报文的数据长度
+ * @param tw_isn 复用TIME_WAIT时指定的初始序号，0表示没有
+ * @return tcp_connect_t* 握手完成时新建的连接(ESTABLISHED)，否则为NULL
  */
-static void close_port_fn(void* key, void* value, time_t* timestamp) {
-    tcp_key_t* tcp_key = key;
-    tcp_connect_t* connect = value;
-    if (tcp_key->dst_port == delete_port) {
-        release_tcp_connect(connect);
+static tcp_connect_t* tcp_listen_in(tcp_listener_t* listener, tcp_key_t* key, tcp_hdr_t* hdr, size_t seg_len,
+    uint32_t tw_isn) {
+    tcp_flags_t flags = hdr->flags;
+    uint32_t seq = swap32(hdr->seq_number32);
+    uint32_t ack = swap32(hdr->ack_number32);
+    if (flags.rst) {
+        tcp_syn_entry_t* entry = tcp_syn_entry_lookup(key);
+        if (entry && seq == entry->irs + 1)
+            tcp_syn_entry_free(entry);
+        return NULL;
+    }
+    if (listener == NULL || flags.syn != !flags.ack) {
+        tcp_send_reset(key, hdr, seg_len);
+        return NULL;
+    }
+    if (flags.syn) {
+        tcp_syn_recv(listener, key, hdr, tw_isn);
+        return NULL;
+    }
+
+    if (listener->handler == NULL && listener->accept_count >= listener->backlog) {
+        tcp_stats.listen_overflows++;
+        return NULL;
+    }
+
+    uint16_t mss;
+    tcp_syn_entry_t* entry = tcp_syn_entry_lookup(key);
+    if (entry) {
+        if (ack != entry->iss + 1 || seq != entry->irs + 1) {
+            tcp_send_reset(key, hdr, seg_len);
+            return NULL;
+        }
+        mss = entry->mss;
+        tcp_syn_entry_free(entry);
+    } else {
+        mss = tcp_cookie_check(key, seq - 1, ack - 1);
+        if (mss == 0) {
+            tcp_stats.syncookies_failed++;
+            tcp_send_reset(key, hdr, seg_len);
+            return NULL;
+        }
+        tcp_stats.syncookies_ok++;
     }
+
+    tcp_connect_t* connect = tcp_connect_new(key, listener);
+    if (connect == NULL)
+        return NULL;
+    if (tcp_connect_init_buf(connect, listener, TCP_ESTABLISHED) != 0) {
+        tcp_connect_free(connect);
+        return NULL;
+    }
+    connect->unack_seq = ack;
+    connect->next_seq = ack;
+    connect->ack = seq;
+    connect->remote_mss = mss;
+    connect->remote_win = swap16(hdr->window_size16);
+    tcp_cc_init(connect);
+    tcp_options_t opts;
+    tcp_parse_options(hdr, &opts);
+    tcp_ts_init(connect, &opts);
+    connect->last_recv = net_time_ms();
+    tcp_keepalive_arm(connect);
+    connect->handler = listener->handler;
+    if (connect->handler) {
+        tcp_notify(connect, TCP_CONN_CONNECTED);
+        return connect;
+    }
+    connect->accepted = 0;
+    connect->accept_next = NULL;
+    connect->accept_prev = listener->accept_tail;
+    if (listener->accept_tail)
+        listener->accept_tail->accept_next = connect;
+    else
+        listener->accept_head = connect;
+    listener->accept_tail = connect;
+    listener->accept_count++;
+    return connect;
 }
 
 /**
- * @brief 关闭 port 上的 TCP 连接
- *        供应用层使用
+ * @brief 为主动打开的连接分配本端临时端口，跳过已经被监听的端口以及与已有连接四元组相同的端口
+ *        优先使用不在TIME_WAIT中的四元组，都在TIME_WAIT中时复用第一个找到的，
+ *        新连接的初始序号随时间增长，大于TIME_WAIT中记录的序号
  *
- * @param port
+ * @param key 远端地址已经填好，成功时填入本端端口
+ * @return int 成功为0，端口耗尽为-1
  */
-void tcp_close(uint16_t port) {
-    delete_port = port;
-    map_foreach(&connect_table, close_port_fn);
-    map_delete(&tcp_table, &port);
+static int tcp_port_alloc(tcp_key_t* key) {
+    uint32_t count = TCP_EPHEMERAL_PORT_MAX - TCP_EPHEMERAL_PORT_MIN + 1;
+    uint32_t reuse = TCP_TW_NIL;
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t port = TCP_EPHEMERAL_PORT_MIN + (tcp_port_cursor + i) % count;
+        key->dst_port = port;
+        if (tcp_table[port] != NULL || tcp_connect_lookup(key) != NULL)
+            continue;
+        uint32_t tw = tcp_tw_lookup(key);
+        if (tw == TCP_TW_NIL) {
+            tcp_port_cursor += i + 1;
+            return 0;
+        }
+        if (reuse == TCP_TW_NIL)
+            reuse = tw;
+    }
+    if (reuse == TCP_TW_NIL)
+        return -1;
+    key->dst_port = tw_table.pool[reuse].key.dst_port;
+    tcp_tw_free(reuse);
+    tcp_stats.timewait_recycled++;
+    return 0;
 }
 
+static void tcp_syn_timeout(void* arg);
+
 /**
- * @brief 从 buf 中读取数据到 connect->rx_buf
+ * @brief 以unack_seq为序号(重新)发送SYN，并启动重传定时器
  *
  * @param connect
- * @param buf
- * @return uint16_t 字节数
  */
-static uint16_t tcp_read_from_buf(tcp_connect_t* connect, buf_t* buf) {
-    uint8_t* dst = connect->rx_buf->data + connect->rx_buf->len;
-    buf_add_padding(connect->rx_buf, buf->len);
-    memcpy(dst, buf->data, buf->len);
-    connect->ack += buf->len;
-    return buf->len;
+static void tcp_send_syn(tcp_connect_t* connect) {
+    connect->next_seq = connect->unack_seq;
+    buf_init(&txbuf, 0);
+    tcp_send(&txbuf, connect, (tcp_flags_t){ .syn = 1 });
+    net_timer_set(&connect->rtx_timer, connect->rto, tcp_syn_timeout, connect);
 }
 
 /**
- * @brief 把connect内tx_buf的数据写入到buf里面供tcp_send使用，buf原来的内容会无效。
+ * @brief SYN重传定时器到期：超时时间加倍后重传，次数用完则以TCP_CONN_CLOSED通知应用层并释放连接
  *
- * @param connect
- * @param buf
- * @return uint16_t 字节数
+ * @param arg 连接
  */
-static uint16_t tcp_write_to_buf(tcp_connect_t* connect, buf_t* buf) {
-    uint16_t sent = connect->next_seq - connect->unack_seq;
-    uint16_t size = min32(connect->tx_buf->len - sent, connect->remote_win);
-    buf_init(buf, size);
-    memcpy(buf->data, connect->tx_buf->data + sent, size);
-    connect->next_seq += size;
-    return size;
+static void tcp_syn_timeout(void* arg) {
+    tcp_connect_t* connect = arg;
+    if (connect->retries >= TCP_SYN_RETRIES) {
+        tcp_notify(connect, TCP_CONN_CLOSED);
+        tcp_connect_free(connect);
+        return;
+    }
+    connect->retries++;
+    connect->rto *= 2;
+    tcp_send_syn(connect);
 }
 
 /**
- * @brief 发送TCP包, seq_number32 = connect->next_seq - buf->len
- *        buf里的数据将作为负载，加上tcp头发送出去。如果flags包含syn或fin，seq会递增。
+ * @brief 主动向 ip:port 发起连接，发出SYN后立即返回，进入TCP_SYN_SEND状态
+ *        握手完成时以TCP_CONN_CONNECTED回调，被拒绝或超时以TCP_CONN_CLOSED回调，之后连接被释放
+ *        供应用层使用
  *
- * @param buf
- * @param connect
- * @param flags
+ * @param ip 远端IP
+ * @param port 远端端口
+ * @param handler 回调函数
+ * @return tcp_connect_t* 失败为NULL
  */
-static void tcp_send(buf_t* buf, tcp_connect_t* connect, tcp_flags_t flags) {
-    // printf("<< tcp send >> sz=%zu\n", buf->len);
-    display_flags(flags);
-    size_t prev_len = buf->len;
-    buf_add_header(buf, sizeof(tcp_hdr_t));
-    tcp_hdr_t* hdr = (tcp_hdr_t*)buf->data;
-    hdr->src_port16 = swap16(connect->local_port);
-    hdr->dst_port16 = swap16(connect->remote_port);
-    hdr->seq_number32 = swap32(connect->next_seq - prev_len);
-    hdr->ack_number32 = swap32(connect->ack);
-    hdr->data_offset = sizeof(tcp_hdr_t) / sizeof(uint32_t);
-    hdr->reserved = 0;
-    hdr->flags = flags;
-    hdr->window_size16 = swap16(connect->remote_win);
-    hdr->checksum16 = 0;
-    hdr->urgent_pointer16 = 0;
-    hdr->checksum16 = tcp_checksum(buf, connect->ip, net_if_ip);
-    ip_out(buf, connect->ip, NET_PROTOCOL_TCP);
-    if (flags.syn || flags.fin) {
-        connect->next_seq += 1;
+tcp_connect_t* tcp_connect(uint8_t* ip, uint16_t port, tcp_handler_t handler) {
+    tcp_key_t key = new_tcp_key(ip, net_if_ip, port, 0);
+    if (tcp_port_alloc(&key) != 0)
+        return NULL;
+    tcp_connect_t* connect = tcp_connect_new(&key, NULL);
+    if (connect == NULL)
+        return NULL;
+    if (tcp_connect_init_buf(connect, NULL, TCP_SYN_SEND) != 0) {
+        tcp_connect_free(connect);
+        return NULL;
     }
+    connect->handler = handler;
+    connect->unack_seq = tcp_new_iss(&key);
+    connect->remote_mss = TCP_DEFAULT_MSS;
+    connect->rto = TCP_INITIAL_RTO_MS;
+    tcp_send_syn(connect);
+    return connect;
 }
 
 /**
- * @brief 从外部关闭一个TCP连接, 会发送剩余数据
- *        供应用层使用
+ * @brief 处理TCP_SYN_SEND状态下收到的报文
+ *        ACK号不对的回复RST；带有正确ACK的RST表示对端拒绝连接；
+ *        SYN+ACK完成握手：记录对端初始序号和MSS，回复ACK，进入ESTABLISHED并回调TCP_CONN_CONNECTED。
+ *        不支持同时打开，单独的SYN被忽略，由定时器重传SYN。
  *
  * @param connect
+ * @param key
+ * @param hdr
+ * @param seg_len 报文的数据长度
  */
-void tcp_connect_close(tcp_connect_t* connect) {
-    if (connect->state == TCP_ESTABLISHED) {
-        tcp_write_to_buf(connect, &txbuf);
-        tcp_send(&txbuf, connect, tcp_flags_ack_fin);
-        connect->state = TCP_FIN_WAIT_1;
+static void tcp_syn_sent_in(tcp_connect_t* connect, tcp_key_t* key, tcp_hdr_t* hdr, size_t seg_len) {
+    tcp_flags_t flags = hdr->flags;
+    uint32_t seq = swap32(hdr->seq_number32);
+    uint32_t ack = swap32(hdr->ack_number32);
+    if (flags.ack && ack != connect->next_seq) {
+        tcp_send_reset(key, hdr, seg_len);
         return;
     }
-    tcp_key_t key = new_tcp_key(connect->ip, connect->remote_port, connect->local_port);
-    release_tcp_connect(connect);
-    map_delete(&connect_table, &key);
+    if (flags.rst) {
+        if (flags.ack) {
+            tcp_notify(connect, TCP_CONN_CLOSED);
+            tcp_connect_free(connect);
+        }
+        return;
+    }
+    if (!flags.syn || !flags.ack)
+        return;
+
+    tcp_options_t opts;
+    tcp_parse_options(hdr, &opts);
+    net_timer_cancel(&connect->rtx_timer);
+    connect->remote_mss = min32(opts.mss ? opts.mss : TCP_DEFAULT_MSS, TCP_MSS);
+    tcp_cc_init(connect);
+    tcp_ts_init(connect, &opts);
+    connect->last_recv = net_time_ms();
+    tcp_keepalive_arm(connect);
+    connect->remote_win = swap16(hdr->window_size16);
+    connect->unack_seq = ack;
+    connect->ack = seq + 1;
+    connect->state = TCP_ESTABLISHED;
+    buf_init(&txbuf, 0);
+    tcp_send(&txbuf, connect, tcp_flags_ack);
+    tcp_notify(connect, TCP_CONN_CONNECTED);
+    tcp_output(connect);
 }
 
 /**
@@ -233,18 +1892,41 @@ void tcp_connect_close(tcp_connect_t* connect) {
  * @return size_t
  */
 size_t tcp_connect_read(tcp_connect_t* connect, uint8_t* data, size_t len) {
-    buf_t* rx_buf = connect->rx_buf;
-    size_t size = min32(rx_buf->len, len);
-    memcpy(data, rx_buf->data, size);
-    if (buf_remove_header(rx_buf, size) != 0) {
-        memmove(rx_buf->payload, rx_buf->data, rx_buf->len);
-        rx_buf->data = rx_buf->payload;
-    }
-    return size;
+    return ringbuf_read(&connect->rx_buf, data, len);
+}
+
+/**
+ * @brief 取得rx_buf中offset处连续存放的数据，不复制也不移除，用于在接收缓存中原地解析。
+ *        供应用层使用
+ *
+ * @param connect
+ * @param offset 相对第一个未读字节的偏移
+ * @param len 输入最多需要的长度，输出实际连续可读的长度，为0表示offset之后没有数据
+ * @return const uint8_t* 数据地址
+ */
+const uint8_t* tcp_connect_peek(tcp_connect_t* connect, size_t offset, size_t* len) {
+    uint32_t n = min64(*len, UINT32_MAX);
+    const uint8_t* data = ringbuf_span(&connect->rx_buf, min64(offset, UINT32_MAX), &n);
+    *len = n;
+    return data;
+}
+
+/**
+ * @brief 从rx_buf头部移除len字节已经处理过的数据，和tcp_connect_peek配合使用。
+ *        供应用层使用
+ *
+ * @param connect
+ * @param len
+ * @return size_t 实际移除的字节数
+ */
+size_t tcp_connect_discard(tcp_connect_t* connect, size_t len) {
+    return ringbuf_discard(&connect->rx_buf, min64(len, UINT32_MAX));
 }
 
 /**
- * @brief 往connect的tx_buf里面写东西，返回成功的字节数，这里要判断窗口够不够，否则图片显示不全。
+ * @brief 往connect的tx_buf里面写东西，返回成功的字节数，tx_buf放不下的部分不会写入。
+ *        写入后按发送策略发送；在该连接的回调中写入时，等回调返回后再发送，这样多次写入可以合并成一个段。
+ *        tx_buf写满时立即把窗口允许的数据发出去。
  *        供应用层使用
  *
  * @param connect
@@ -253,24 +1935,189 @@ size_t tcp_connect_read(tcp_connect_t* connect, uint8_t* data, size_t len) {
  */
 size_t tcp_connect_write(tcp_connect_t* connect, const uint8_t* data, size_t len) {
     // printf("tcp_connect_write size: %zu\n", len);
-    buf_t* tx_buf = connect->tx_buf;
+    if (tcp_connect_closing(connect))
+        return 0;
+    size_t size = ringbuf_write(&connect->tx_buf, data, len);
+    if (size < len)
+        connect->want_sent = 1;
+    if (connect != tcp_notifying || ringbuf_space(&connect->tx_buf) == 0) {
+        tcp_output(connect);
+    }
+    return size;
+}
+
+/**
+ * @brief 判断tx_buf能否一次写下len字节，不能时在腾出空间后以TCP_CONN_DATA_SENT回调，
+ *        用于不能只写一部分的数据，比如一个完整的响应头。
+ *        供应用层使用
+ *
+ * @param connect
+ * @param len
+ * @return int 能写下为1，否则为0
+ */
+int tcp_connect_writable(tcp_connect_t* connect, size_t len) {
+    if (tcp_connect_closing(connect))
+        return 0;
+    if (ringbuf_space(&connect->tx_buf) >= len)
+        return 1;
+    connect->want_sent = 1;
+    return 0;
+}
 
-    uint8_t* dst = tx_buf->data + tx_buf->len;
-    size_t size = min32(&tx_buf->payload[BUF_MAX_LEN] - dst, len);
+/**
+ * @brief tx_buf中还能写入的字节数，用于要自己决定一次写多少的数据，比如chunked编码的一块。
+ *        供应用层使用
+ *
+ * @param connect
+ * @return size_t
+ */
+size_t tcp_connect_space(tcp_connect_t* connect) {
+    return tcp_connect_closing(connect) ? 0 : ringbuf_space(&connect->tx_buf);
+}
+
+/**
+ * @brief 本端是否已经开始关闭，这时FIN已经排在发送队列末尾，不能再写入数据：
+ *        之后的数据序号会在FIN之后。tx_buf中已有的数据照常发送。
+ *        只看本端，对端关闭(CLOSE_WAIT)后仍然可以写入
+ *        供应用层使用
+ *
+ * @param connect
+ * @return int 已经开始关闭为1
+ */
+int tcp_connect_closing(tcp_connect_t* connect) {
+    return connect->fin_queued || connect->fin_sent;
+}
+
+/**
+ * @brief 把外部数据挂到发送队列末尾，排在目前tx_buf中所有数据之后，然后按发送策略发送
+ *
+ * @param connect
+ * @param ext data和len已经填好
+ */
+static void tcp_extent_append(tcp_connect_t* connect, tcp_extent_t* ext) {
+    ext->ring_before = ringbuf_len(&connect->tx_buf);
+    for (tcp_extent_t* e = connect->tx_ext; e; e = e->next)
+        ext->ring_before -= e->ring_before;
+    ext->next = NULL;
+    if (connect->tx_ext_tail)
+        connect->tx_ext_tail->next = ext;
+    else
+        connect->tx_ext = ext;
+    connect->tx_ext_tail = ext;
+    connect->tx_file_len += ext->len;
+    if (connect != tcp_notifying)
+        tcp_output(connect);
+}
 
-    if (connect->next_seq - connect->unack_seq + len >= connect->remote_win) {
+/**
+ * @brief 把文件fd中从offset开始的len字节加入发送队列，超出文件末尾的部分不加入。
+ *        文件区域用mmap映射后直接挂在发送队列上，不复制到tx_buf，也不受tx_buf容量限制；
+ *        只在组装报文段时复制一次，同时算出校验和。全部被确认后解除映射，在此之前文件内容不应被修改。
+ *        之后再用tcp_connect_write写入的数据排在文件数据之后。
+ *        供应用层使用
+ *
+ * @param connect
+ * @param fd 以读方式打开的文件，调用后即可关闭
+ * @param offset 文件中的起始位置
+ * @param len
+ * @return size_t 加入发送队列的字节数，失败为0
+ */
+size_t tcp_connect_sendfile(tcp_connect_t* connect, int fd, off_t offset, size_t len) {
+    struct stat st;
+    if (tcp_connect_closing(connect) || fstat(fd, &st) != 0 || offset < 0 || offset >= st.st_size)
         return 0;
-    }
-    if (buf_add_padding(tx_buf, size) != 0) {
-        memmove(tx_buf->payload, tx_buf->data, tx_buf->len);
-        tx_buf->data = tx_buf->payload;
-        if (tcp_write_to_buf(connect, &txbuf)) {
-            tcp_send(&txbuf, connect, tcp_flags_ack);
-        }
+    len = min64(len, st.st_size - offset);
+    len = min64(len, INT32_MAX - tcp_tx_len(connect)); // 发送队列不能超过序号空间的一半
+#ifdef _WIN32
+    // 没有mmap，退回到读入tx_buf
+    uint8_t data[4096];
+    size_t size = 0;
+    if (lseek(fd, offset, SEEK_SET) != offset)
         return 0;
+    while (size < len && ringbuf_space(&connect->tx_buf) > 0) {
+        int n = read(fd, data, min64(min64(sizeof(data), len - size), ringbuf_space(&connect->tx_buf)));
+        if (n <= 0)
+            break;
+        size += tcp_connect_write(connect, data, n);
     }
-    memcpy(dst, data, size);
     return size;
+#else
+    if (len == 0)
+        return 0;
+    off_t base = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    tcp_extent_t* ext = malloc(sizeof(tcp_extent_t));
+    if (ext == NULL)
+        return 0;
+    ext->map_len = offset - base + len;
+    ext->map = mmap(NULL, ext->map_len, PROT_READ, MAP_SHARED, fd, base);
+    if (ext->map == MAP_FAILED) {
+        free(ext);
+        return 0;
+    }
+    ext->release = NULL;
+    ext->sums = NULL;
+    ext->data = (uint8_t*)ext->map + (offset - base);
+    ext->len = len;
+    tcp_extent_append(connect, ext);
+    return len;
+#endif
+}
+
+/**
+ * @brief 把应用层的一段内存加入发送队列，不复制；全部被确认或者连接释放后调用release(arg)，
+ *        在此之前内存不能修改或释放。用于缓存中可以被多个连接同时发送的数据。
+ *        供应用层使用
+ *
+ * @param connect
+ * @param data
+ * @param len
+ * @param sums 可选，从data开始每TCP_SUM_BLOCK字节一块的部分校验和(checksum_add)，最后不满一块的部分可以没有
+ * @param release 不再引用这段内存时的回调
+ * @param arg
+ * @return size_t 加入发送队列的字节数，失败为0，这时不会调用release
+ */
+size_t tcp_connect_send_ref(tcp_connect_t* connect, const uint8_t* data, size_t len, const uint32_t* sums, tcp_release_t release, void* arg) {
+    if (tcp_connect_closing(connect) || len == 0 || len > INT32_MAX - tcp_tx_len(connect))
+        return 0;
+    tcp_extent_t* ext = malloc(sizeof(tcp_extent_t));
+    if (ext == NULL)
+        return 0;
+    ext->release = release;
+    ext->arg = arg;
+    ext->sums = sums;
+    ext->sum_base = data;
+    ext->data = data;
+    ext->len = len;
+    tcp_extent_append(connect, ext);
+    return len;
+}
+
+/**
+ * @brief 设置连接的发送策略，从CORK切换到其他策略时发出积攒的数据
+ *        供应用层使用
+ *
+ * @param connect
+ * @param policy
+ */
+void tcp_connect_set_policy(tcp_connect_t* connect, tcp_send_policy_t policy) {
+    tcp_send_policy_t old = connect->policy;
+    connect->policy = policy;
+    if (old == TCP_SEND_CORK && policy != TCP_SEND_CORK)
+        tcp_connect_flush(connect);
+    else if (policy == TCP_SEND_NODELAY)
+        tcp_output(connect);
+}
+
+/**
+ * @brief 立即发出tx_buf中已经写入的全部数据(对端窗口允许的部分)，不受发送策略限制
+ *        供应用层使用
+ *
+ * @param connect
+ */
+void tcp_connect_flush(tcp_connect_t* connect) {
+    connect->push = 1;
+    connect->push_seq = connect->unack_seq + tcp_tx_len(connect);
+    tcp_output(connect);
 }
 
 /**
@@ -295,11 +2142,14 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
 
    // TODO
    tcp_hdr_t* hdr = (tcp_hdr_t *) buf->data;
-   uint16_t checksum_backup = hdr->checksum16;
-   hdr->checksum16 = 0;
-   uint16_t checksum = tcp_checksum(buf, src_ip, net_if_ip);
-   if (checksum_backup != checksum) return;
-   hdr->checksum16 = checksum_backup;
+   if (!buf->csum_verified) // GRO合并的包已经逐段验证过
+   {
+        uint16_t checksum_backup = hdr->checksum16;
+        hdr->checksum16 = 0;
+        uint16_t checksum = tcp_checksum(buf, src_ip, net_if_ip);
+        if (checksum_backup != checksum) return;
+        hdr->checksum16 = checksum_backup;
+   }
 
     /*
     3、从tcp头部字段中获取source port、destination port、
@@ -312,36 +2162,29 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
    uint32_t seq_number = swap32(hdr->seq_number32);
    uint32_t ack_number = swap32(hdr->ack_number32);
    tcp_flags_t flags = hdr->flags;
-   uint32_t get_seq = seq_number;
+   tcp_options_t opts;
+   tcp_parse_options(hdr, &opts);
 
     /*
-    4、调用map_get函数，根据destination port查找对应的handler函数
+    4、根据destination port直接索引tcp_table，找到对应的监听端口
     */
 
    // TODO
-   tcp_handler_t* handler = map_get(&tcp_table, &dst_port);
+   tcp_listener_t* listener = tcp_table[dst_port];
 
     /*
-    5、调用new_tcp_key函数，根据通信五元组中的源IP地址、目标IP地址、目标端口号确定一个tcp链接key
+    5、调用new_tcp_key函数，根据通信四元组中的源IP地址、目标IP地址、源端口号、目标端口号确定一个tcp链接key
     */
 
    // TODO
-   tcp_key_t tcp_key = new_tcp_key(src_ip, src_port, dst_port);
+   tcp_key_t tcp_key = new_tcp_key(src_ip, net_if_ip, src_port, dst_port);
 
     /*
-    6、调用map_get函数，根据key查找一个tcp_connect_t* connect，
-    如果没有找到，则调用map_set建立新的链接，并设置为CONNECT_LISTEN状态，然后调用mag_get获取到该链接。
+    6、调用tcp_connect_lookup函数，根据key在哈希表中查找一个tcp_connect_t* connect
     */
 
     // TODO
-    tcp_connect_t* connect = map_get(&connect_table, &tcp_key);
-    if (connect == NULL)
-    {
-        tcp_connect_t new_connect;
-        new_connect.state = TCP_LISTEN;
-        map_set(&connect_table, &tcp_key, &new_connect);
-        connect = map_get(&connect_table, &tcp_key);
-    }
+    tcp_connect_t* connect = tcp_connect_lookup(&tcp_key);
 
     /*
     7、从TCP头部字段中获取对方的窗口大小，注意大小端转换
@@ -351,52 +2194,74 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
    uint16_t window_size = swap16(hdr->window_size16);
 
     /*
-    8、如果为TCP_LISTEN状态，则需要完成如下功能：
-        （1）如果收到的flag带有rst，则close_tcp关闭tcp链接
-        （2）如果收到的flag不是syn，则reset_tcp复位通知。因为收到的第一个包必须是syn
-        （3）调用init_tcp_connect_rcvd函数，初始化connect，将状态设为TCP_SYN_RCVD
-        （4）填充connect字段，包括
-            local_port、remote_port、ip、
-            unack_seq（设为随机值）、由于是对syn的ack应答包，next_seq与unack_seq一致
-            ack设为对方的sequence number+1
-            设置remote_win为对方的窗口大小，注意大小端转换
-        （5）调用buf_init初始化txbuf
-        （6）调用tcp_send将txbuf发送出去，也就是回复一个tcp_flags_ack_syn（SYN+ACK）报文
-        （7）处理结束，返回。
+    8、如果没有找到连接，则调用tcp_listen_in处理：
+        （1）SYN进入半连接队列并回复SYN+ACK，队列满时改用SYN cookie，都不分配连接
+        （2）握手的最后一个ACK从半连接队列或cookie中恢复握手参数，这时才分配连接并进入ESTABLISHED，
+            回调TCP_CONN_CONNECTED之后，这个ACK可能携带的数据继续按ESTABLISHED处理
+        （3）没有监听的端口以及其他报文回复RST
+        在此之前先查找TIME_WAIT，由tcp_timewait_in处理，只有能开始新连接的SYN才继续交给tcp_listen_in
     */
 
    // TODO
-   if (connect->state == TCP_LISTEN)
+   if (connect == NULL)
    {
-        if (flags.rst) goto close_tcp;
-        if (!flags.syn) goto reset_tcp;
-        init_tcp_connect_rcvd(connect);
-        connect->local_port = dst_port;
-        connect->remote_port = src_port;
-        memcpy(connect->ip, src_ip, NET_IP_LEN);
-        srand((unsigned) time(NULL));
-        connect->unack_seq = rand();            // 设为随机值
-        connect->next_seq = connect->unack_seq; // 设为与 unack_seq 相同的随机值
-        connect->ack = seq_number + 1;
-        connect->remote_win = window_size;
-        buf_init(connect->tx_buf, 0);
-        tcp_send(connect->tx_buf, connect, tcp_flags_ack_syn);
+        uint32_t tw = tcp_tw_lookup(&tcp_key), tw_isn = 0;
+        if (tw != TCP_TW_NIL && !tcp_timewait_in(tw, hdr, buf->len - 4 * hdr->data_offset, &tw_isn)) return;
+        connect = tcp_listen_in(listener, &tcp_key, hdr, buf->len - 4 * hdr->data_offset, tw_isn);
+        if (connect == NULL) return;
+   }
+   connect->last_recv = net_time_ms(); // 任何报文都说明对端还在，保活定时器到期时据此重新计算
+   connect->probes_sent = 0;
+   connect->persist_probes = 0;
+
+    /*
+    主动打开的连接在TCP_SYN_SEND状态下还不知道对端的序号，不能按9检查，交给tcp_syn_sent_in处理
+    */
+   if (connect->state == TCP_SYN_SEND)
+   {
+        tcp_syn_sent_in(connect, &tcp_key, hdr, buf->len - 4 * hdr->data_offset);
+        return;
+   }
+
+    /*
+    PAWS：协商了时间戳的连接上，时间戳比ts_recent旧的报文是序号回绕前的旧报文，丢弃并回复ACK(RFC 7323 5.3)
+    */
+   if (connect->ts_ok && opts.ts && !flags.rst && (int32_t)(opts.tsval - connect->ts_recent) < 0)
+   {
+        tcp_stats.paws_rejected++;
+        tcp_ack_schedule(connect, 1);
         return;
    }
 
     /* 
-    9、检查接收到的sequence number，如果与ack序号不一致,则reset_tcp复位通知。
+    9、检查接收到的sequence number，如果与ack序号不一致，说明是乱序或重复的报文(包括对端重传的SYN+ACK)，
+        丢弃它并立即回复ACK，告诉对端期望的序号；乱序的RST直接丢弃
     */
 
    // TODO
-   if (seq_number != connect->ack) goto reset_tcp;
+   if (seq_number != connect->ack)
+   {
+        if (!flags.rst) tcp_ack_schedule(connect, 1);
+        return;
+   }
 
     /* 
-    10、检查flags是否有rst标志，如果有，则close_tcp连接重置
+    10、检查flags是否有rst标志，如果有，则以TCP_CONN_CLOSED通知应用层后close_tcp连接重置
     */
 
    // TODO
-   if (flags.rst) goto close_tcp;
+   if (flags.rst)
+   {
+        tcp_notify(connect, TCP_CONN_CLOSED);
+        goto close_tcp;
+   }
+
+    /*
+    序号正确的报文，如果它没有超过最后发出的ACK号，记下它的时间戳，之后发出的报文回显给对端(RFC 7323 4.3)
+    */
+   if (connect->ts_ok && opts.ts && (int32_t)(opts.tsval - connect->ts_recent) >= 0 &&
+       (int32_t)(seq_number - connect->last_ack_sent) <= 0)
+        connect->ts_recent = opts.tsval;
 
     /*
     11、序号相同时的处理，调用buf_remove_header去除头部后剩下的都是数据
@@ -404,6 +2269,7 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
 
    // TODO
    buf_remove_header(buf, 4 * ((uint16_t) hdr->data_offset));
+   uint16_t read_buf_len;
 
     /* 状态转换
     */
@@ -415,23 +2281,8 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
     case TCP_SYN_RCVD:
 
 //         /*
-//         12、在RCVD状态，如果收到的包没有ack flag，则不做任何处理
-//         */  
-
-//        // TODO
-        if (!flags.ack) break;
-
-//         /*
-//         13、如果是ack包，需要完成如下功能：
-//             （1）将unack_seq +1
-//             （2）将状态转成ESTABLISHED
-//             （3）调用回调函数，完成三次握手，进入连接状态TCP_CONN_CONNECTED。
+//         12、被动打开的连接在握手完成时才分配，直接进入ESTABLISHED，不会处于RCVD状态
 //         */
-        
-//         // TODO
-        connect->unack_seq++;
-        connect->state = TCP_ESTABLISHED;
-        (* handler)(connect, TCP_CONN_CONNECTED);
         break;
 
     case TCP_ESTABLISHED:
@@ -445,19 +2296,12 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
 
 //         /*
 //         15、这里先处理ACK的值，
-//             如果是ack包，
-//             且unack_seq小于sequence number（说明有部分数据被对端接收确认了，否则可能是之前重发的ack，可以不处理），
-//             且next_seq大于sequence number
-//             则调用buf_remove_header函数，去掉被对端接收确认的部分数据，并更新unack_seq值
+//             如果是ack包，调用tcp_ack_process去掉被对端接收确认的部分数据，更新unack_seq值和对端窗口
             
 //         */
 
 //        // TODO
-        if ((flags.ack) && (connect->unack_seq < ack_number))
-        {
-            buf_remove_header(connect->tx_buf, ack_number - connect->unack_seq);
-            connect->unack_seq = ack_number;
-        }
+        if (flags.ack) tcp_ack_process(connect, ack_number, window_size, buf->len + flags.fin, opts.ts ? opts.tsecr : 0);
 
 //         /*
 //         16、然后接收数据
@@ -465,73 +2309,126 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
 //         */
 
 //        // TODO
-        uint16_t read_buf_len = tcp_read_from_buf(connect, buf);
+        read_buf_len = tcp_read_from_buf(connect, buf);
 
 //         /*
 //         17、再然后，根据当前的标志位进一步处理
 //             （1）首先调用buf_init初始化txbuf
-//             （2）判断是否收到关闭请求（FIN），如果是，将状态改为TCP_LAST_ACK，ack +1，再发送一个ACK + FIN包，并退出，
-//                 这样就无需进入CLOSE_WAIT，直接等待对方的ACK
-//             （3）如果不是FIN，则看看是否有数据，如果有，则发ACK响应，并调用handler回调函数进行处理
-//             （4）调用tcp_write_to_buf函数，看看是否有数据需要发送，如果有，同时发数据和ACK
-//             （5）没有收到数据，可能对方只发一个ACK，可以不响应
+//             （2）应用层在等待发送缓存时以TCP_CONN_DATA_SENT回调；再看看是否有数据，如果有，则调用handler回调函数进行处理
+//             （3）判断是否收到关闭请求（FIN），负载全部放入rx_buf后才接受FIN：ack +1，立即确认，
+//                 进入TCP_CLOSE_WAIT并以TCP_CONN_PEER_CLOSED通知应用层，应用层写完剩下的响应后调用tcp_connect_close
+//                 进入TCP_LAST_ACK，数据发完后发出FIN；回调中应用层已经关闭了连接，则是同时关闭，进入TCP_CLOSING
+//             （4）调用tcp_output函数，把需要发送的数据按MSS分段，ACK搭载在数据段上
+//             （5）收到了数据但没有数据可以搭载ACK，调用tcp_ack_schedule延迟确认；rx_buf放不下时立即确认
+//             （6）没有收到数据，可能对方只发一个ACK，可以不响应
 
 //         */
 
 //        // TODO
         buf_init(&txbuf, 0);
-        buf_init(connect->tx_buf, 0);
-        if (flags.fin)
+        if (connect->want_sent && ringbuf_space(&connect->tx_buf) > 0)
         {
-            connect->state = TCP_LAST_ACK;
-            connect->ack++;
-            tcp_send(connect->tx_buf, connect, tcp_flags_ack_fin);
+            connect->want_sent = 0;
+            tcp_notify(connect, TCP_CONN_DATA_SENT);
         }
-        else
+        if (read_buf_len > 0)
+        {
+            // GRO合并的包按合并前的段数计数，保证每两个段至少确认一次
+            connect->ack_pending += buf->gso_size ? (read_buf_len + buf->gso_size - 1) / buf->gso_size : 1;
+            tcp_notify(connect, TCP_CONN_DATA_RECV);
+        }
+        if (flags.fin && read_buf_len == buf->len)
         {
-            if (read_buf_len > 0)
+            connect->ack++;
+            if (connect->state == TCP_FIN_WAIT_1)
             {
-                (* handler)(connect, TCP_CONN_DATA_RECV);
-                tcp_send(&txbuf, connect, tcp_flags_ack);
+                connect->state = TCP_CLOSING;
             }
-            uint16_t write_buf_len = tcp_write_to_buf(connect, &txbuf);
-            if (write_buf_len > 0)
+            else
             {
-                tcp_send(&txbuf, connect, tcp_flags_ack);
+                connect->state = TCP_CLOSE_WAIT;
+                tcp_notify(connect, TCP_CONN_PEER_CLOSED);
             }
+            tcp_output(connect);
+            // 对端的FIN要立即确认：本端FIN可能要等数据发完，也可能已经在回调中带着旧的ACK号发出
+            if (connect->last_ack_sent != connect->ack)
+                tcp_ack_schedule(connect, 1);
+            break;
         }
+        tcp_output(connect);
+        if (connect->ack_pending || read_buf_len < buf->len)
+            tcp_ack_schedule(connect, read_buf_len < buf->len);
         break;
 
     case TCP_CLOSE_WAIT:
-        panic("switch TCP_CLOSE_WAIT", __LINE__);
+//         /*
+//         对端不会再发数据，只处理ACK；继续发送应用层写入的数据，发送缓存腾出空间时以TCP_CONN_DATA_SENT回调，
+//         等应用层调用tcp_connect_close进入TCP_LAST_ACK
+//         */
+        if (flags.ack) tcp_ack_process(connect, ack_number, window_size, buf->len + flags.fin, opts.ts ? opts.tsecr : 0);
+        buf_init(&txbuf, 0);
+        if (connect->want_sent && ringbuf_space(&connect->tx_buf) > 0)
+        {
+            connect->want_sent = 0;
+            tcp_notify(connect, TCP_CONN_DATA_SENT);
+        }
+        tcp_output(connect);
         break;
 
     case TCP_FIN_WAIT_1:
 
 //         /*
-//         18、如果收到FIN && ACK，则close_tcp直接关闭TCP
-//             如果只收到ACK，则将状态转为TCP_FIN_WAIT_2
+//         18、先处理ACK并继续发送tx_buf中剩余的数据，数据发完后才会发出FIN，对端发来的数据照常接收
+//             如果收到FIN，回复ACK，本端FIN已被确认则进入TIME_WAIT，否则是同时关闭，进入TCP_CLOSING
+//             没有收到FIN但本端FIN已被确认，则将状态转为TCP_FIN_WAIT_2
 //         */
 
 //        // TODO
-        if (flags.fin && flags.ack) goto close_tcp;
-        if (flags.ack) connect->state = TCP_FIN_WAIT_2;
+        if (flags.ack) tcp_ack_process(connect, ack_number, window_size, buf->len + flags.fin, opts.ts ? opts.tsecr : 0);
+        read_buf_len = tcp_read_from_buf(connect, buf);
+        tcp_output(connect);
+        if (flags.fin && read_buf_len == buf->len)
+        {
+            connect->ack++;
+            buf_init(&txbuf, 0);
+            tcp_send(&txbuf, connect, tcp_flags_ack);
+            if (connect->fin_sent && connect->unack_seq == connect->next_seq) goto time_wait;
+            connect->state = TCP_CLOSING;
+            break;
+        }
+        if (buf->len > 0) tcp_ack_schedule(connect, 1);
+        if (connect->fin_sent && connect->unack_seq == connect->next_seq)
+        {
+            connect->state = TCP_FIN_WAIT_2;
+            tcp_keepalive_arm(connect);
+        }
+        break;
+
+    case TCP_CLOSING:
+//         /*
+//         等待本端FIN被确认，确认后进入TIME_WAIT
+//         */
+        if (flags.ack) tcp_ack_process(connect, ack_number, window_size, buf->len + flags.fin, opts.ts ? opts.tsecr : 0);
+        tcp_output(connect);
+        if (connect->fin_sent && connect->unack_seq == connect->next_seq) goto time_wait;
         break;
 
     case TCP_FIN_WAIT_2:
 //         /*
-//         19、如果不是FIN，则不做处理
-//             如果是，则将ACK +1，调用buf_init初始化txbuf，调用tcp_send发送一个ACK数据包，再close_tcp关闭TCP
+//         19、接收对端发来的数据，如果不是FIN，则不做其他处理
+//             如果是，则将ACK +1，调用buf_init初始化txbuf，调用tcp_send发送一个ACK数据包，再进入TIME_WAIT
 //         */
 
 //        // TODO
-        if (flags.fin)
+        read_buf_len = tcp_read_from_buf(connect, buf);
+        if (flags.fin && read_buf_len == buf->len)
         {
             connect->ack++;
-            buf_init(connect->tx_buf, 0);
-            tcp_send(connect->tx_buf, connect, tcp_flags_ack);
-            goto close_tcp;
+            buf_init(&txbuf, 0);
+            tcp_send(&txbuf, connect, tcp_flags_ack);
+            goto time_wait;
         }
+        if (buf->len > 0) tcp_ack_schedule(connect, 1);
         break;
 
     case TCP_LAST_ACK:
@@ -541,9 +2438,11 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
 //         */
 
 //        // TODO
-        if (flags.ack)
+        if (flags.ack) tcp_ack_process(connect, ack_number, window_size, buf->len + flags.fin, opts.ts ? opts.tsecr : 0);
+        tcp_output(connect);
+        if (connect->fin_sent && connect->unack_seq == connect->next_seq)
         {
-            (* handler)(connect, TCP_CONN_CLOSED);
+            tcp_notify(connect, TCP_CONN_CLOSED);
             goto close_tcp;
         }
         break;
@@ -554,14 +2453,10 @@ void tcp_in(buf_t* buf, uint8_t* src_ip) {
     }
     return;
 
-reset_tcp:
-    printf("!!! reset tcp !!!\n");
-    connect->next_seq = 0;
-    connect->ack = get_seq + 1;
-    buf_init(&txbuf, 0);
-    tcp_send(&txbuf, connect, tcp_flags_ack_rst);
+time_wait:
+    tcp_connect_timewait(connect);
+    return;
 close_tcp:
-    release_tcp_connect(connect);
-    map_delete(&connect_table, &tcp_key);
+    tcp_connect_free(connect);
     return;
 }
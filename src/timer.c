@@ -0,0 +1,114 @@
+#include <time.h>
+#include "timer.h"
+
+/**
+ * @brief 时间轮，每格是一个双向链表，定时器按到期的tick挂到对应的格上
+ *        超过一圈的定时器留在格中，转到时再比较到期时间
+ * 
+ */
+static net_timer_t timer_wheel[NET_TIMER_SLOTS];
+
+/**
+ * @brief 上一次处理到的tick
+ * 
+ */
+static uint64_t timer_tick;
+
+/**
+ * @brief 获取单调递增的毫秒时间
+ * 
+ * @return uint64_t 毫秒
+ */
+uint64_t net_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 初始化时间轮
+ * 
+ */
+void net_timer_init()
+{
+    for (size_t i = 0; i < NET_TIMER_SLOTS; i++)
+        timer_wheel[i].prev = timer_wheel[i].next = &timer_wheel[i];
+    timer_tick = net_time_ms() / NET_TIMER_TICK_MS;
+}
+
+/**
+ * @brief 启动或重新启动一个定时器
+ * 
+ * @param timer 要启动的定时器，如果正在计时会先取消
+ * @param timeout_ms 超时毫秒数
+ * @param handler 到期回调
+ * @param arg 回调参数
+ */
+void net_timer_set(net_timer_t *timer, uint32_t timeout_ms, net_timer_handler_t handler, void *arg)
+{
+    net_timer_cancel(timer);
+    timer->expire = net_time_ms() + timeout_ms;
+    timer->handler = handler;
+    timer->arg = arg;
+    uint64_t tick = (timer->expire + NET_TIMER_TICK_MS - 1) / NET_TIMER_TICK_MS;
+    if (tick <= timer_tick)
+        tick = timer_tick + 1;
+    net_timer_t *slot = &timer_wheel[tick & (NET_TIMER_SLOTS - 1)];
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+
+/**
+ * @brief 取消定时器，没有在计时的定时器也可以取消
+ * 
+ * @param timer 要取消的定时器
+ */
+void net_timer_cancel(net_timer_t *timer)
+{
+    if (!net_timer_pending(timer))
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+/**
+ * @brief 处理到期的定时器，回调中可以重新启动或取消定时器
+ * 
+ */
+void net_timer_poll()
+{
+    uint64_t now = net_time_ms();
+    uint64_t now_tick = now / NET_TIMER_TICK_MS;
+    if (now_tick - timer_tick > NET_TIMER_SLOTS)
+        timer_tick = now_tick - NET_TIMER_SLOTS;
+    while (timer_tick < now_tick)
+    {
+        timer_tick++;
+        net_timer_t *slot = &timer_wheel[timer_tick & (NET_TIMER_SLOTS - 1)];
+        net_timer_t expired = {.prev = &expired, .next = &expired};
+        net_timer_t *timer = slot->next;
+        while (timer != slot)
+        {
+            net_timer_t *next = timer->next;
+            if (timer->expire <= now)
+            {
+                net_timer_cancel(timer);
+                timer->prev = expired.prev;
+                timer->next = &expired;
+                expired.prev->next = timer;
+                expired.prev = timer;
+            }
+            timer = next;
+        }
+        while (expired.next != &expired)
+        {
+            timer = expired.next;
+            net_timer_cancel(timer);
+            timer->handler(timer->arg);
+        }
+    }
+}
@@ -103,4 +103,76 @@ uint16_t checksum16(uint16_t *data, size_t len)
 
     // Step3: 将上述和的低 16 位进行取反，得到校验和
     return (~sum) & 0xFFFF;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 累加16位校验和的部分和，不折叠也不取反，用于分段拼接校验和
+ *        data必须从被校验数据的偶数偏移处开始，len为奇数时只能是最后一段
+ * 
+ * @param data 要累加的数据
+ * @param len 数据长度
+ * @param sum 之前的部分和
+ * @return uint32_t 新的部分和
+ */
+uint32_t checksum_add(const void *data, size_t len, uint32_t sum)
+{
+    const uint8_t *p = data;
+    uint64_t acc = sum;
+    uint16_t word;
+    for (; len > 1; p += 2, len -= 2)
+    {
+        memcpy(&word, p, 2);
+        acc += word;
+    }
+    if (len)
+    {
+        word = 0;
+        memcpy(&word, p, 1);
+        acc += word;
+    }
+    while (acc >> 32)
+        acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+/**
+ * @brief 把checksum_add得到的部分和折叠成16位并取反，结果与checksum16相同
+ * 
+ * @param sum 部分和
+ * @return uint16_t 校验和
+ */
+uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (~sum) & 0xFFFF;
+}
+
+/**
+ * @brief 复制数据的同时累加16位校验和的部分和，一次遍历完成，避免复制后再读一遍
+ *        对齐要求同checksum_add
+ * 
+ * @param dst 目标地址
+ * @param src 源地址
+ * @param len 长度
+ * @param sum 之前的部分和
+ * @return uint32_t 新的部分和
+ */
+uint32_t checksum_copy(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    uint64_t acc = sum;
+    uint64_t word;
+    // 反码和按32位累加再折叠与按16位累加结果相同
+    for (; len >= 8; d += 8, s += 8, len -= 8)
+    {
+        memcpy(&word, s, 8);
+        memcpy(d, &word, 8);
+        acc += (word & 0xFFFFFFFF) + (word >> 32);
+    }
+    while (acc >> 32)
+        acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    memcpy(d, s, len);
+    return checksum_add(d, len, (uint32_t)acc);
+}
@@ -0,0 +1,636 @@
+/**
+ * @file http_bench.c
+ * @brief HTTP服务器压测程序。驱动换成内存中的帧队列，由脚本化的客户端直接收发以太网帧，
+ *        整个协议栈和HTTP服务器都在同一个进程里跑，不需要网卡和pcap。
+ *        客户端开N个持久连接，每个连接依次GET几个不同大小的文件，最后报告每秒请求数、吞吐量和延迟分位数。
+ *        客户端同时检查服务器发出的每个帧的IP和TCP校验和，并把响应体和磁盘上的文件逐字节比较，
+ *        任何一项出错都以非0退出，因此也作为ctest的端到端测试。
+ *
+ *        用法: http_bench [连接数] [每个连接的请求数] [选项...]
+ *        选项: nots      SYN里不携带时间戳选项(默认携带)
+ *              pipeline  每个连接把所有请求一次发完，最后一个段带FIN，要求服务器回完全部响应后再关闭
+ *        在构建目录下运行，测试文件写在XHTTP_DOC_DIR里，结束时删除。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "net.h"
+#include "driver.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "ip.h"
+#include "tcp.h"
+#include "http.h"
+
+#define BENCH_PORT 80
+#define BENCH_CLIENT_PORT 10000
+#define BENCH_QUEUE_LEN 8192   // 客户端到服务器方向最多排队的帧数
+#define BENCH_WINDOW 65535     // 客户端通告的接收窗口，收到的数据立即消费掉
+#define BENCH_RESP_HEAD_MAX 2048
+#define BENCH_TIMEOUT_SEC 60   // 超过这个时间还没跑完就认为卡住了
+
+typedef struct bench_file {
+    const char* name;
+    size_t size;
+    uint8_t created; // 由压测程序创建，结束时删除
+    uint8_t* data;   // 文件内容，用来比较响应体
+} bench_file_t;
+
+// 前三个能进静态文件缓存，最后一个超过HTTP_CACHE_FILE_MAX，走sendfile
+static bench_file_t bench_files[] = {
+    {"/bench-1k.bin", 1024},
+    {"/bench-16k.bin", 16 * 1024},
+    {"/bench-256k.bin", 256 * 1024},
+    {"/bench-2m.bin", 2 * 1024 * 1024},
+};
+#define BENCH_FILE_COUNT (sizeof(bench_files) / sizeof(bench_files[0]))
+
+typedef enum bench_state {
+    BENCH_SYN_SENT,
+    BENCH_IDLE,    // 已建立，没有未完成的请求
+    BENCH_WAITING, // 请求已发出，等待响应
+    BENCH_FIN_WAIT, // 流水线模式下响应都已收齐，等待服务器的FIN
+    BENCH_DONE,
+} bench_state_t;
+
+typedef struct bench_conn {
+    uint16_t port;
+    bench_state_t state;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint8_t need_ack;          // 收到了数据，这一轮要回一个ACK
+    uint8_t ts_ok;             // 服务器在SYN ACK里回了时间戳，之后每个段都带时间戳
+    uint32_t ts_recent;        // 要回显给服务器的时间戳
+    int requests;              // 已完成的请求数
+    uint64_t sent_ns;          // 当前请求发出的时间
+    char head[BENCH_RESP_HEAD_MAX]; // 响应头，收齐空行前先攒在这里
+    size_t head_len;
+    uint64_t body_left;        // 响应体还剩多少字节，head_len为0且body_left为0时表示在等新的响应头
+    uint8_t in_body;
+    const bench_file_t* file;  // 当前响应对应的文件
+    size_t body_off;           // 已经比较过的响应体长度
+} bench_conn_t;
+
+typedef struct bench_frame {
+    size_t len;
+    uint8_t data[ETHERNET_MAX_TRANSPORT_UNIT + sizeof(ether_hdr_t)];
+} bench_frame_t;
+
+static bench_frame_t bench_queue[BENCH_QUEUE_LEN]; // 客户端发往服务器的帧，driver_recv从这里取
+static size_t queue_head, queue_count;
+
+static uint8_t client_ip[NET_IP_LEN];
+static uint8_t client_mac[NET_MAC_LEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static uint8_t server_mac_known;
+
+static bench_conn_t* conns;
+static int conn_count, requests_per_conn;
+static int conns_done;
+static uint32_t* latencies_us;
+static size_t latency_count;
+static uint64_t bytes_received, bad_responses, bad_bodies, bad_checksums, bad_options;
+static uint8_t doc_dir_created;
+static uint8_t offer_ts = 1, pipeline;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 第i个请求对应的文件，各连接错开，保证每种大小都有连接在请求
+ */
+static const bench_file_t* request_file(const bench_conn_t* conn, int i) {
+    return &bench_files[(conn - conns + i) % BENCH_FILE_COUNT];
+}
+
+/**
+ * @brief 取一个空闲的帧槽位，队列满说明服务器处理得太慢或者客户端逻辑出错，直接退出
+ */
+static bench_frame_t* queue_alloc(void) {
+    if (queue_count == BENCH_QUEUE_LEN) {
+        fprintf(stderr, "http_bench: frame queue overflow\n");
+        exit(1);
+    }
+    return &bench_queue[(queue_head + queue_count++) % BENCH_QUEUE_LEN];
+}
+
+static void queue_arp(uint16_t opcode, const uint8_t* target_mac, const uint8_t* target_ip) {
+    bench_frame_t* frame = queue_alloc();
+    ether_hdr_t* eth = (ether_hdr_t*)frame->data;
+    memcpy(eth->dst, opcode == ARP_REQUEST ? (const uint8_t*)"\xff\xff\xff\xff\xff\xff" : target_mac, NET_MAC_LEN);
+    memcpy(eth->src, client_mac, NET_MAC_LEN);
+    eth->protocol16 = swap16(NET_PROTOCOL_ARP);
+    arp_pkt_t* arp = (arp_pkt_t*)(eth + 1);
+    arp->hw_type16 = swap16(ARP_HW_ETHER);
+    arp->pro_type16 = swap16(NET_PROTOCOL_IP);
+    arp->hw_len = NET_MAC_LEN;
+    arp->pro_len = NET_IP_LEN;
+    arp->opcode16 = swap16(opcode);
+    memcpy(arp->sender_mac, client_mac, NET_MAC_LEN);
+    memcpy(arp->sender_ip, client_ip, NET_IP_LEN);
+    memcpy(arp->target_mac, target_mac, NET_MAC_LEN);
+    memcpy(arp->target_ip, target_ip, NET_IP_LEN);
+    frame->len = sizeof(ether_hdr_t) + sizeof(arp_pkt_t);
+}
+
+/**
+ * @brief 以客户端的身份构造一个TCP段放进发往服务器的队列
+ */
+static void queue_segment(bench_conn_t* conn, tcp_flags_t flags, const void* data, size_t len) {
+    bench_frame_t* frame = queue_alloc();
+    uint8_t opt[TCP_OPT_MSS_LEN + TCP_OPT_TS_SPACE] = {TCP_OPT_MSS, TCP_OPT_MSS_LEN, TCP_MSS >> 8, TCP_MSS & 0xFF};
+    size_t opt_len = flags.syn ? TCP_OPT_MSS_LEN : 0;
+    if (flags.syn ? offer_ts : conn->ts_ok) {
+        uint32_t tsval = swap32((uint32_t)(now_ns() / 1000000)), tsecr = swap32(conn->ts_recent);
+        uint8_t* ts = opt + opt_len;
+        ts[0] = TCP_OPT_NOP;
+        ts[1] = TCP_OPT_NOP;
+        ts[2] = TCP_OPT_TS;
+        ts[3] = TCP_OPT_TS_LEN;
+        memcpy(ts + 4, &tsval, 4);
+        memcpy(ts + 8, &tsecr, 4);
+        opt_len += TCP_OPT_TS_SPACE;
+    }
+    size_t tcp_len = sizeof(tcp_hdr_t) + opt_len + len;
+
+    ether_hdr_t* eth = (ether_hdr_t*)frame->data;
+    memcpy(eth->dst, net_if_mac, NET_MAC_LEN);
+    memcpy(eth->src, client_mac, NET_MAC_LEN);
+    eth->protocol16 = swap16(NET_PROTOCOL_IP);
+
+    ip_hdr_t* ip = (ip_hdr_t*)(eth + 1);
+    memset(ip, 0, sizeof(ip_hdr_t));
+    ip->version = IP_VERSION_4;
+    ip->hdr_len = sizeof(ip_hdr_t) / IP_HDR_LEN_PER_BYTE;
+    ip->total_len16 = swap16(sizeof(ip_hdr_t) + tcp_len);
+    ip->ttl = 64;
+    ip->protocol = NET_PROTOCOL_TCP;
+    memcpy(ip->src_ip, client_ip, NET_IP_LEN);
+    memcpy(ip->dst_ip, net_if_ip, NET_IP_LEN);
+    ip->hdr_checksum16 = checksum16((uint16_t*)ip, sizeof(ip_hdr_t));
+
+    tcp_hdr_t* tcp = (tcp_hdr_t*)(ip + 1);
+    memset(tcp, 0, sizeof(tcp_hdr_t));
+    tcp->src_port16 = swap16(conn->port);
+    tcp->dst_port16 = swap16(BENCH_PORT);
+    tcp->seq_number32 = swap32(conn->snd_nxt);
+    tcp->ack_number32 = swap32(flags.ack ? conn->rcv_nxt : 0);
+    tcp->data_offset = (sizeof(tcp_hdr_t) + opt_len) / sizeof(uint32_t);
+    tcp->flags = flags;
+    tcp->window_size16 = swap16(BENCH_WINDOW);
+    memcpy((uint8_t*)(tcp + 1), opt, opt_len);
+    memcpy((uint8_t*)(tcp + 1) + opt_len, data, len);
+
+    tcp_peso_hdr_t peso;
+    memcpy(peso.src_ip, client_ip, NET_IP_LEN);
+    memcpy(peso.dst_ip, net_if_ip, NET_IP_LEN);
+    peso.placeholder = 0;
+    peso.protocol = NET_PROTOCOL_TCP;
+    peso.total_len16 = swap16(tcp_len);
+    tcp->checksum16 = checksum_fold(checksum_add(tcp, tcp_len, checksum_add(&peso, sizeof(peso), 0)));
+
+    frame->len = sizeof(ether_hdr_t) + sizeof(ip_hdr_t) + tcp_len;
+    conn->snd_nxt += len + flags.syn + flags.fin;
+    conn->need_ack = 0;
+}
+
+static int format_request(char* req, size_t size, const bench_file_t* file) {
+    return snprintf(req, size, "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n", file->name);
+}
+
+static void send_request(bench_conn_t* conn) {
+    char req[256];
+    int len = format_request(req, sizeof(req), request_file(conn, conn->requests));
+    conn->state = BENCH_WAITING;
+    conn->sent_ns = now_ns();
+    queue_segment(conn, (tcp_flags_t){.ack = 1, .psh = 1}, req, len);
+}
+
+/**
+ * @brief 流水线模式：把所有请求拼在一起按MSS切段一次发完，最后一个段同时带FIN。
+ *        请求总长远小于服务器的接收缓存，不需要等窗口
+ */
+static void send_pipeline(bench_conn_t* conn) {
+    char* reqs = malloc(256 * requests_per_conn);
+    size_t total = 0;
+    for (int i = 0; i < requests_per_conn; i++)
+        total += format_request(reqs + total, 256, request_file(conn, i));
+    size_t mss = TCP_MSS - (conn->ts_ok ? TCP_OPT_TS_SPACE : 0);
+    conn->state = BENCH_WAITING;
+    conn->sent_ns = now_ns();
+    for (size_t off = 0; off < total; off += mss) {
+        size_t len = total - off < mss ? total - off : mss;
+        queue_segment(conn, (tcp_flags_t){.ack = 1, .psh = 1, .fin = off + len == total}, reqs + off, len);
+    }
+    free(reqs);
+}
+
+static void response_done(bench_conn_t* conn) {
+    latencies_us[latency_count++] = (uint32_t)((now_ns() - conn->sent_ns) / 1000);
+    conn->head_len = 0;
+    conn->in_body = 0;
+    conn->sent_ns = now_ns(); // 流水线模式下下一个响应的延迟从这里算起
+    if (++conn->requests < requests_per_conn) {
+        if (!pipeline)
+            conn->state = BENCH_IDLE;
+    } else if (pipeline) {
+        conn->state = BENCH_FIN_WAIT; // FIN已经随最后一个请求发出
+    } else {
+        // 所有请求完成，主动关闭，不等服务器的FIN
+        queue_segment(conn, (tcp_flags_t){.ack = 1, .fin = 1}, NULL, 0);
+        conn->state = BENCH_DONE;
+        conns_done++;
+    }
+}
+
+/**
+ * @brief 消费一段按序到达的响应数据：先攒响应头，解析出Content-Length后按长度跳过响应体
+ */
+static void response_in(bench_conn_t* conn, const uint8_t* data, size_t len) {
+    bytes_received += len;
+    while (len > 0 && conn->state == BENCH_WAITING) {
+        if (conn->in_body) {
+            size_t n = len < conn->body_left ? len : conn->body_left;
+            if (conn->file && memcmp(data, conn->file->data + conn->body_off, n) != 0) {
+                fprintf(stderr, "http_bench: body of %s differs near offset %zu on port %u\n",
+                        conn->file->name, conn->body_off, conn->port);
+                bad_bodies++;
+                conn->file = NULL; // 一个响应只报一次
+            }
+            conn->body_off += n;
+            conn->body_left -= n;
+            data += n;
+            len -= n;
+            if (conn->body_left == 0)
+                response_done(conn);
+            continue;
+        }
+        size_t n = len;
+        if (n > sizeof(conn->head) - 1 - conn->head_len)
+            n = sizeof(conn->head) - 1 - conn->head_len;
+        memcpy(conn->head + conn->head_len, data, n);
+        conn->head[conn->head_len + n] = 0;
+        char* end = strstr(conn->head, "\r\n\r\n");
+        if (end == NULL) {
+            conn->head_len += n;
+            if (conn->head_len == sizeof(conn->head) - 1) {
+                fprintf(stderr, "http_bench: response head too long on port %u\n", conn->port);
+                exit(1);
+            }
+            return;
+        }
+        // 头的结尾落在这次拷贝的数据里，多拷的部分属于响应体
+        size_t used = end + 4 - conn->head - conn->head_len;
+        data += used;
+        len -= used;
+        char* cl = strstr(conn->head, "Content-Length: ");
+        conn->body_left = cl ? strtoull(cl + 16, NULL, 10) : 0;
+        conn->file = request_file(conn, conn->requests);
+        conn->body_off = 0;
+        if (strncmp(conn->head, "HTTP/1.1 200 ", 13) != 0 || conn->body_left != conn->file->size) {
+            fprintf(stderr, "http_bench: bad response for %s on port %u: %.*s\n",
+                    conn->file->name, conn->port, (int)strcspn(conn->head, "\r"), conn->head);
+            bad_responses++;
+            conn->file = NULL; // 长度对不上时不再比较内容
+        }
+        conn->in_body = 1;
+        if (conn->body_left == 0)
+            response_done(conn);
+    }
+    if (len > 0) {
+        fprintf(stderr, "http_bench: %zu unexpected bytes after the last response on port %u\n", len, conn->port);
+        bad_responses++;
+    }
+}
+
+/**
+ * @brief 取出服务器报文里的时间戳选项，没有时返回0
+ */
+static int parse_ts(const tcp_hdr_t* tcp, uint32_t* tsval) {
+    const uint8_t* opt = (const uint8_t*)(tcp + 1);
+    const uint8_t* end = (const uint8_t*)tcp + tcp->data_offset * sizeof(uint32_t);
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            return 0;
+        if (opt[0] == TCP_OPT_TS && opt[1] == TCP_OPT_TS_LEN) {
+            memcpy(tsval, opt + 2, 4);
+            *tsval = swap32(*tsval);
+            return 1;
+        }
+        opt += opt[1];
+    }
+    return 0;
+}
+
+static bench_conn_t* conn_find(uint16_t port) {
+    if (port < BENCH_CLIENT_PORT || port >= BENCH_CLIENT_PORT + conn_count)
+        return NULL;
+    return &conns[port - BENCH_CLIENT_PORT];
+}
+
+/**
+ * @brief 客户端处理服务器发出的一个TCP段，只更新状态，回复的ACK留到主循环里合并发送
+ */
+static void client_tcp_in(const tcp_hdr_t* tcp, size_t tcp_len) {
+    bench_conn_t* conn = conn_find(swap16(tcp->dst_port16));
+    if (conn == NULL || conn->state == BENCH_DONE)
+        return;
+    if (tcp->flags.rst) {
+        fprintf(stderr, "http_bench: connection on port %u reset\n", conn->port);
+        exit(1);
+    }
+    uint32_t seq = swap32(tcp->seq_number32);
+    size_t hdr_len = tcp->data_offset * sizeof(uint32_t);
+    const uint8_t* data = (const uint8_t*)tcp + hdr_len;
+    size_t len = tcp_len - hdr_len;
+    uint32_t tsval;
+    int has_ts = parse_ts(tcp, &tsval);
+
+    if (conn->state == BENCH_SYN_SENT) {
+        if (!tcp->flags.syn || !tcp->flags.ack)
+            return;
+        conn->rcv_nxt = seq + 1;
+        conn->ts_ok = has_ts;
+        conn->ts_recent = has_ts ? tsval : 0;
+        if (has_ts != offer_ts) {
+            fprintf(stderr, "http_bench: timestamp option %s in SYN ACK on port %u\n", has_ts ? "unexpected" : "missing", conn->port);
+            bad_options++;
+        }
+        queue_segment(conn, tcp_flags_ack, NULL, 0);
+        if (pipeline)
+            send_pipeline(conn);
+        else
+            send_request(conn);
+        return;
+    }
+    // 协商了时间戳以后服务器的每个段都必须带上(RFC 7323 3.2)
+    if (has_ts != conn->ts_ok) {
+        bad_options++;
+    } else if (has_ts && (int32_t)(tsval - conn->ts_recent) >= 0) {
+        conn->ts_recent = tsval;
+    }
+    // 内存里的链路不丢包也不乱序，重传的旧数据裁掉，超前的数据丢弃并回重复ACK
+    int32_t offset = (int32_t)(conn->rcv_nxt - seq);
+    if (offset < 0 || (size_t)offset > len) {
+        conn->need_ack = 1;
+        return;
+    }
+    data += offset;
+    len -= offset;
+    if (len > 0) {
+        conn->rcv_nxt += len;
+        conn->need_ack = 1;
+        response_in(conn, data, len);
+    }
+    if (tcp->flags.fin && conn->state == BENCH_FIN_WAIT) {
+        conn->rcv_nxt++;
+        queue_segment(conn, tcp_flags_ack, NULL, 0);
+        conn->state = BENCH_DONE;
+        conns_done++;
+    } else if (tcp->flags.fin && conn->state != BENCH_DONE) {
+        fprintf(stderr, "http_bench: server closed connection on port %u after %d requests\n", conn->port, conn->requests);
+        exit(1);
+    }
+}
+
+/**
+ * @brief 检查服务器发出的IP头部校验和与TCP校验和，包括GSO切分出来的每个帧
+ */
+static int checksum_ok(const ip_hdr_t* ip, size_t ip_hdr_len, const tcp_hdr_t* tcp, size_t tcp_len) {
+    if (checksum_fold(checksum_add(ip, ip_hdr_len, 0)) != 0)
+        return 0;
+    tcp_peso_hdr_t peso;
+    memcpy(peso.src_ip, ip->src_ip, NET_IP_LEN);
+    memcpy(peso.dst_ip, ip->dst_ip, NET_IP_LEN);
+    peso.placeholder = 0;
+    peso.protocol = NET_PROTOCOL_TCP;
+    peso.total_len16 = swap16(tcp_len);
+    return checksum_fold(checksum_add(tcp, tcp_len, checksum_add(&peso, sizeof(peso), 0))) == 0;
+}
+
+int driver_open() {
+    return 0;
+}
+
+int driver_recv(buf_t* buf) {
+    if (queue_count == 0)
+        return 0;
+    bench_frame_t* frame = &bench_queue[queue_head];
+    queue_head = (queue_head + 1) % BENCH_QUEUE_LEN;
+    queue_count--;
+    buf_init(buf, frame->len);
+    memcpy(buf->data, frame->data, frame->len);
+    return frame->len;
+}
+
+/**
+ * @brief 服务器发出的帧直接交给客户端处理
+ */
+int driver_send(buf_t* buf) {
+    if (buf->len < sizeof(ether_hdr_t))
+        return 0;
+    const ether_hdr_t* eth = (const ether_hdr_t*)buf->data;
+    if (eth->protocol16 == swap16(NET_PROTOCOL_ARP)) {
+        const arp_pkt_t* arp = (const arp_pkt_t*)(eth + 1);
+        if (memcmp(arp->target_ip, client_ip, NET_IP_LEN) != 0)
+            return 0;
+        if (arp->opcode16 == swap16(ARP_REQUEST))
+            queue_arp(ARP_REPLY, arp->sender_mac, arp->sender_ip);
+        else
+            server_mac_known = 1;
+        return 0;
+    }
+    if (eth->protocol16 != swap16(NET_PROTOCOL_IP))
+        return 0;
+    const ip_hdr_t* ip = (const ip_hdr_t*)(eth + 1);
+    if (ip->protocol != NET_PROTOCOL_TCP || memcmp(ip->dst_ip, client_ip, NET_IP_LEN) != 0)
+        return 0;
+    size_t ip_hdr_len = ip->hdr_len * IP_HDR_LEN_PER_BYTE;
+    const tcp_hdr_t* tcp = (const tcp_hdr_t*)((const uint8_t*)ip + ip_hdr_len);
+    size_t tcp_len = swap16(ip->total_len16) - ip_hdr_len;
+    if (!checksum_ok(ip, ip_hdr_len, tcp, tcp_len)) {
+        fprintf(stderr, "http_bench: bad checksum in frame to port %u\n", swap16(tcp->dst_port16));
+        bad_checksums++;
+        return 0; // 真实的客户端会丢掉这个帧，交给服务器重传
+    }
+    client_tcp_in(tcp, tcp_len);
+    return 0;
+}
+
+void driver_close() {
+}
+
+static int create_files(void) {
+    doc_dir_created = mkdir(XHTTP_DOC_DIR, 0755) == 0;
+    for (size_t i = 0; i < BENCH_FILE_COUNT; i++) {
+        bench_file_t* file = &bench_files[i];
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", XHTTP_DOC_DIR, file->name);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+            continue; // 已经存在就用现有的，由load_files读出实际内容
+        uint8_t block[4096];
+        for (size_t j = 0; j < sizeof(block); j++)
+            block[j] = (uint8_t)(j * 7 + i);
+        for (size_t left = file->size; left > 0;) {
+            size_t n = left < sizeof(block) ? left : sizeof(block);
+            if (write(fd, block, n) != (ssize_t)n) {
+                close(fd);
+                return -1;
+            }
+            left -= n;
+        }
+        close(fd);
+        file->created = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 把测试文件读进内存用来比较响应体，文件长度以磁盘上的为准
+ */
+static int load_files(void) {
+    for (size_t i = 0; i < BENCH_FILE_COUNT; i++) {
+        bench_file_t* file = &bench_files[i];
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", XHTTP_DOC_DIR, file->name);
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0)
+            return -1;
+        if (fstat(fd, &st) != 0 || (file->data = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+            close(fd);
+            return -1;
+        }
+        file->size = st.st_size;
+        for (size_t off = 0; off < file->size;) {
+            ssize_t n = read(fd, file->data + off, file->size - off);
+            if (n <= 0) {
+                close(fd);
+                return -1;
+            }
+            off += n;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_files(void) {
+    for (size_t i = 0; i < BENCH_FILE_COUNT; i++) {
+        free(bench_files[i].data);
+        bench_files[i].data = NULL;
+        if (!bench_files[i].created)
+            continue;
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", XHTTP_DOC_DIR, bench_files[i].name);
+        unlink(path);
+    }
+    if (doc_dir_created)
+        rmdir(XHTTP_DOC_DIR);
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p) {
+    size_t i = (size_t)(p * (latency_count - 1) + 0.5);
+    return latencies_us[i];
+}
+
+int main(int argc, char const* argv[]) {
+    conn_count = argc > 1 ? atoi(argv[1]) : 64;
+    requests_per_conn = argc > 2 ? atoi(argv[2]) : 50;
+    int usage_error = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "nots") == 0)
+            offer_ts = 0;
+        else if (strcmp(argv[i], "pipeline") == 0)
+            pipeline = 1;
+        else
+            usage_error = 1;
+    }
+    if (usage_error || conn_count <= 0 || conn_count > 4096 || requests_per_conn <= 0 || requests_per_conn > HTTP_MAX_KEEPALIVE_REQUESTS) {
+        fprintf(stderr, "usage: %s [connections 1-4096] [requests per connection 1-%d] [nots] [pipeline]\n", argv[0], HTTP_MAX_KEEPALIVE_REQUESTS);
+        return 1;
+    }
+    if (create_files() != 0 || load_files() != 0) {
+        fprintf(stderr, "http_bench: cannot create test files in %s\n", XHTTP_DOC_DIR);
+        remove_files();
+        return 1;
+    }
+    conns = calloc(conn_count, sizeof(bench_conn_t));
+    latencies_us = malloc(sizeof(uint32_t) * conn_count * requests_per_conn);
+    if (conns == NULL || latencies_us == NULL || net_init() != 0 || http_server_open(BENCH_PORT) != 0) {
+        fprintf(stderr, "http_bench: init failed\n");
+        remove_files();
+        return 1;
+    }
+
+    // 客户端和服务器在同一网段
+    memcpy(client_ip, net_if_ip, NET_IP_LEN);
+    client_ip[3] = net_if_ip[3] == 1 ? 2 : 1;
+    // 先用ARP请求让服务器学到客户端的MAC，免得大量SYN ACK挤在arp_buf里只留下一个
+    queue_arp(ARP_REQUEST, (const uint8_t[NET_MAC_LEN]){0}, net_if_ip);
+    while (!server_mac_known)
+        net_poll();
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < conn_count; i++) {
+        bench_conn_t* conn = &conns[i];
+        conn->port = BENCH_CLIENT_PORT + i;
+        conn->snd_nxt = 1000000u * (i + 1);
+        conn->state = BENCH_SYN_SENT;
+        queue_segment(conn, (tcp_flags_t){.syn = 1}, NULL, 0);
+    }
+    while (conns_done < conn_count) {
+        net_poll();
+        http_server_run();
+        for (int i = 0; i < conn_count; i++) {
+            bench_conn_t* conn = &conns[i];
+            if (conn->state == BENCH_IDLE)
+                send_request(conn); // 捎带了ACK
+            else if (conn->need_ack)
+                queue_segment(conn, tcp_flags_ack, NULL, 0);
+        }
+        if (now_ns() - start > BENCH_TIMEOUT_SEC * 1000000000ull) {
+            fprintf(stderr, "http_bench: timed out with %d/%d connections finished\n", conns_done, conn_count);
+            remove_files();
+            return 1;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    // 让服务器处理完最后的FIN
+    net_poll();
+    http_server_run();
+
+    double sec = elapsed / 1e9;
+    qsort(latencies_us, latency_count, sizeof(uint32_t), cmp_u32);
+    printf("connections:  %d\n", conn_count);
+    printf("requests:     %zu (%llu bad responses, %llu bad bodies)\n", latency_count,
+           (unsigned long long)bad_responses, (unsigned long long)bad_bodies);
+    printf("frames:       %llu bad checksums, %llu bad options\n",
+           (unsigned long long)bad_checksums, (unsigned long long)bad_options);
+    printf("elapsed:      %.3f s\n", sec);
+    printf("requests/sec: %.0f\n", latency_count / sec);
+    printf("throughput:   %.1f MB/s\n", bytes_received / sec / (1024 * 1024));
+    printf("latency us:   p50 %u  p90 %u  p99 %u  max %u\n",
+           percentile(0.5), percentile(0.9), percentile(0.99), latencies_us[latency_count - 1]);
+
+    remove_files();
+    free(latencies_us);
+    free(conns);
+    return bad_responses || bad_bodies || bad_checksums || bad_options ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * @file unit_test.c
+ * @brief 协议栈内部工具的单元测试：环形缓冲区、部分校验和、分块校验和、SYN cookie和时间轮。
+ *        直接包含tcp.c以便测试其中的static函数，驱动是空实现，不依赖pcap。
+ *        任何检查失败都以非0退出。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ringbuf.h"
+#include "utils.h"
+#include "timer.h"
+#include "../src/tcp.c"
+
+static int failures;
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                              \
+        }                                                                            \
+    } while (0)
+
+int driver_open() {
+    return 0;
+}
+
+int driver_recv(buf_t* buf) {
+    return 0;
+}
+
+int driver_send(buf_t* buf) {
+    return 0;
+}
+
+void driver_close() {
+}
+
+/**
+ * @brief 逐字节按网络字节序计算的参考校验和，和被测的实现没有共用代码
+ *
+ * @return uint16_t 网络字节序的取反校验和
+ */
+static uint16_t ref_checksum(const uint8_t* data, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += i & 1 ? data[i] : data[i] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+/**
+ * @brief 被测实现按主机字节序返回结果，换成网络字节序再和参考值比较
+ */
+static uint16_t host_checksum(uint32_t sum) {
+    return swap16(checksum_fold(sum));
+}
+
+static void test_ringbuf(void) {
+    ringbuf_t rb;
+    uint8_t in[256], out[256];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (uint8_t)(i * 13 + 5);
+
+    CHECK(ringbuf_init(&rb, 100) == 0);
+    CHECK(rb.size == 128); // 向上取整为2的幂
+    CHECK(ringbuf_len(&rb) == 0 && ringbuf_space(&rb) == 128);
+
+    // 读写位置放在32位回绕前，写入跨过数组末尾和计数器回绕
+    rb.head = rb.tail = UINT32_MAX - 40;
+    CHECK(ringbuf_write(&rb, in, 100) == 100);
+    CHECK(ringbuf_len(&rb) == 100 && ringbuf_space(&rb) == 28);
+    CHECK(ringbuf_write(&rb, in + 100, 50) == 28); // 只写入放得下的部分
+    CHECK(ringbuf_space(&rb) == 0);
+
+    // peek不移动读位置，偏移和长度超出时截断
+    memset(out, 0, sizeof(out));
+    CHECK(ringbuf_peek(&rb, 30, out, 60) == 60);
+    CHECK(memcmp(out, in + 30, 60) == 0);
+    CHECK(ringbuf_peek(&rb, 120, out, 60) == 8);
+    CHECK(memcmp(out, in + 120, 8) == 0);
+    CHECK(ringbuf_peek(&rb, 128, out, 1) == 0);
+    CHECK(ringbuf_len(&rb) == 128);
+
+    // span只给出到数组末尾为止的连续部分
+    uint32_t len = 128;
+    const uint8_t* span = ringbuf_span(&rb, 0, &len);
+    CHECK(len == (uint32_t)(rb.size - (rb.head & (rb.size - 1))));
+    CHECK(memcmp(span, in, len) == 0);
+    uint32_t first = len;
+    len = 128 - first;
+    span = ringbuf_span(&rb, first, &len);
+    CHECK(len == 128 - first);
+    CHECK(memcmp(span, in + first, len) == 0);
+
+    CHECK(ringbuf_discard(&rb, 50) == 50);
+    CHECK(ringbuf_read(&rb, out, 10) == 10);
+    CHECK(memcmp(out, in + 50, 10) == 0);
+    CHECK(ringbuf_read(&rb, out, sizeof(out)) == 68);
+    CHECK(memcmp(out, in + 60, 68) == 0);
+    CHECK(ringbuf_len(&rb) == 0);
+    CHECK(ringbuf_discard(&rb, 1) == 0);
+    ringbuf_free(&rb);
+}
+
+static void test_checksum(void) {
+    uint8_t data[320], dst[330];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(rand() & 0xFF);
+    memset(data + 64, 0xFF, 32); // 一段全1，检验进位折叠
+
+    // checksum16要求2字节对齐，只在偶数偏移上比较
+    for (size_t len = 0; len <= 256; len += 2)
+        CHECK(swap16(checksum16((uint16_t*)data, len)) == ref_checksum(data, len));
+
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; len <= 257; len++) {
+            uint16_t ref = ref_checksum(data + off, len);
+            CHECK(host_checksum(checksum_add(data + off, len, 0)) == ref);
+            // 在偶数位置分两次累加，结果和一次算完相同
+            size_t half = (len / 2) & ~(size_t)1;
+            CHECK(host_checksum(checksum_add(data + off + half, len - half, checksum_add(data + off, half, 0))) == ref);
+            // 源和目的地址的对齐方式不同时也要边复制边算对
+            size_t doff = (off * 3 + 1) % 8;
+            memset(dst, 0, sizeof(dst));
+            CHECK(host_checksum(checksum_copy(dst + doff, data + off, len, 0)) == ref);
+            CHECK(memcmp(dst + doff, data + off, len) == 0);
+        }
+    }
+}
+
+static void test_extent_sum(void) {
+    uint8_t data[TCP_SUM_BLOCK * 6 + 17];
+    uint32_t sums[(sizeof(data) + TCP_SUM_BLOCK - 1) / TCP_SUM_BLOCK];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i * 31 + (i >> 3));
+    for (size_t i = 0; i < sizeof(sums) / sizeof(sums[0]); i++) {
+        size_t len = sizeof(data) - i * TCP_SUM_BLOCK;
+        sums[i] = checksum_add(data + i * TCP_SUM_BLOCK, len < TCP_SUM_BLOCK ? len : TCP_SUM_BLOCK, 0);
+    }
+    tcp_extent_t ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.sums = sums;
+    ext.sum_base = data;
+
+    // 起点和长度覆盖块内奇偶偏移、恰好跨块和跨多块的情况
+    for (uint32_t off = 0; off < TCP_SUM_BLOCK * 2 + 3; off++) {
+        for (uint32_t len = 0; off + len <= sizeof(data); len += len < 8 ? 1 : 7) {
+            uint16_t ref = ref_checksum(data + off, len);
+            CHECK(host_checksum(tcp_extent_sum(&ext, data + off, len)) == ref);
+        }
+    }
+}
+
+static void test_syn_cookie(void) {
+    static const uint16_t mss[] = {100, 536, 1000, 1220, 1300, 1440, 1459, 1460, 9000};
+    static const uint16_t expect[] = {536, 536, 536, 1220, 1220, 1440, 1440, 1460, 1460};
+    uint8_t ip[NET_IP_LEN] = {192, 168, 1, 10};
+    uint8_t other_ip[NET_IP_LEN] = {192, 168, 1, 11};
+    tcp_key_t key = new_tcp_key(ip, net_if_ip, 40000, 80);
+    tcp_key_t other_port = new_tcp_key(ip, net_if_ip, 40001, 80);
+    tcp_key_t other_host = new_tcp_key(other_ip, net_if_ip, 40000, 80);
+
+    for (size_t i = 0; i < sizeof(mss) / sizeof(mss[0]); i++) {
+        uint32_t irs = 0x12345678u * (uint32_t)(i + 1);
+        uint32_t cookie = tcp_cookie_make(&key, irs, mss[i]);
+        CHECK(tcp_cookie_check(&key, irs, cookie) == expect[i]);
+        // 篡改cookie的哈希或计数器部分、对端序号或四元组都不能通过校验。
+        // 最低几位是MSS编号，差一两的篡改会落到相邻编号上，这是编码方式决定的，不在这里检查
+        CHECK(tcp_cookie_check(&key, irs, cookie + 0x00010000) == 0);
+        CHECK(tcp_cookie_check(&key, irs, cookie ^ 0x00800000) == 0);
+        CHECK(tcp_cookie_check(&key, irs, cookie + (1u << 24)) == 0);
+        CHECK(tcp_cookie_check(&key, irs - 0x00010000, cookie) == 0);
+        CHECK(tcp_cookie_check(&other_port, irs, cookie) == 0);
+        CHECK(tcp_cookie_check(&other_host, irs, cookie) == 0);
+    }
+    // 换了密钥，旧的cookie全部失效
+    uint32_t cookie = tcp_cookie_make(&key, 1, 1460);
+    tcp_secret[1] ^= 0x5A5A5A5A;
+    CHECK(tcp_cookie_check(&key, 1, cookie) == 0);
+    tcp_secret[1] ^= 0x5A5A5A5A;
+    CHECK(tcp_cookie_check(&key, 1, cookie) == 1460);
+}
+
+typedef struct timer_case {
+    net_timer_t timer;
+    int id;
+    int rearm; // 到期时以这个时间重新设置一次
+} timer_case_t;
+
+static int fired[8], fired_count;
+
+static void timer_case_handler(void* arg) {
+    timer_case_t* tc = arg;
+    if (fired_count < (int)(sizeof(fired) / sizeof(fired[0])))
+        fired[fired_count++] = tc->id;
+    if (tc->rearm) {
+        uint32_t timeout = tc->rearm;
+        tc->rearm = 0;
+        tc->id += 100;
+        net_timer_set(&tc->timer, timeout, timer_case_handler, tc);
+    }
+}
+
+static void test_timer_order(void) {
+    static const uint32_t timeout[] = {50, 10, 30, 20, 40};
+    timer_case_t tc[5];
+    memset(tc, 0, sizeof(tc));
+    fired_count = 0;
+    for (int i = 0; i < 5; i++) {
+        tc[i].id = timeout[i];
+        net_timer_set(&tc[i].timer, timeout[i], timer_case_handler, &tc[i]);
+    }
+    tc[1].rearm = 45;           // 10ms的定时器到期后再等45ms，排在50ms之后
+    net_timer_cancel(&tc[2].timer); // 30ms的不应到期
+    CHECK(!net_timer_pending(&tc[2].timer));
+    net_timer_set(&tc[3].timer, 20, timer_case_handler, &tc[3]); // 重复设置只保留最后一次
+
+    uint64_t deadline = net_time_ms() + 1000;
+    while (fired_count < 5 && net_time_ms() < deadline)
+        net_timer_poll();
+
+    static const int expect[] = {10, 20, 40, 50, 110};
+    CHECK(fired_count == 5);
+    for (int i = 0; i < fired_count && i < 5; i++)
+        CHECK(fired[i] == expect[i]);
+    for (int i = 0; i < 5; i++)
+        CHECK(!net_timer_pending(&tc[i].timer));
+}
+
+int main(int argc, char const* argv[]) {
+    srand(1);
+    if (net_init() != 0) {
+        fprintf(stderr, "unit_test: net_init failed\n");
+        return 1;
+    }
+    test_ringbuf();
+    test_checksum();
+    test_extent_sum();
+    test_syn_cookie();
+    test_timer_order();
+    if (failures)
+        printf("unit_test: %d checks failed\n", failures);
+    else
+        printf("unit_test: all checks passed\n");
+    return failures ? 1 : 0;
+}